@@ -3,47 +3,303 @@
 # https://www.tutorialspoint.com/flask/flask_quick_guide.htm
 # http://flask.pocoo.org/docs/1.0/
 
+import bisect
 import csv
 import os
+import socket
 
-from flask import Flask, render_template
+from flask import Flask, Response, abort, jsonify, render_template, request
 
 app = Flask(__name__)
 
+CSV_DIR = "static/csv"
+PACK_FILE = os.path.join(CSV_DIR, "navs.pack")
+PACK_TRAILER_SIZE = 30
+
+# (content encoding, file extension) in order of preference
+COMPRESSED_VARIANTS = [("br", ".br"), ("gzip", ".gz"), (None, "")]
+
+DAEMON_SOCKET = "downloader.sock"
+
+# pack file name vs (stat key, code vs (offset, length))
+pack_index_cache = {}
+
+NAME_INDEX_FILE = os.path.join(CSV_DIR, "mf_name_index.csv")
+NAME_FILE = os.path.join(CSV_DIR, "mf_code_names.csv")
+MAX_SEARCH_RESULTS = 50
+
+# file name vs (stat key, parsed contents)
+name_cache = {}
+
 
 @app.route('/')
 def default():
 
-    return render_template('mutualfunds.html',
-                           mf_name_codes = get_mf_name_codes())
+    return render_template('mutualfunds.html')
 
 
 @app.route('/mutualfunds')
 def index():
 
-    return render_template('mutualfunds.html',
-                           mf_name_codes = get_mf_name_codes())
+    return render_template('mutualfunds.html')
 
 
 @app.route('/portfolio')
 def portfolio():
 
-    return render_template('portfolio.html',
-                           mf_name_codes = get_mf_name_codes())
+    return render_template('portfolio.html')
+
+
+@app.route('/navs/<int:mfcode>.csv')
+def navs(mfcode):
+
+    # prefer the precompressed variant the client accepts with the highest
+    # q value, then the plain csv; each is served from the packed archive
+    # when present, otherwise from the per fund file
+    accepted = parse_accept_encoding(request.headers.get("Accept-Encoding",
+                                                         ""))
+    variants = []
+    for preference, (encoding, extension) in enumerate(COMPRESSED_VARIANTS):
+        q = accepted.get(encoding, accepted.get("*", 0)) if encoding else 0
+        if q > 0 or not encoding:
+            variants.append((-q, preference, encoding, extension))
+
+    for _, _, encoding, extension in sorted(variants):
+
+        data = read_fund_csv(mfcode, extension)
+        if data is None:
+            continue
+
+        response = Response(data, mimetype="text/csv")
+        response.headers["Vary"] = "Accept-Encoding"
+        if encoding:
+            response.headers["Content-Encoding"] = encoding
+        return response
+
+    abort(404)
+
+
+def parse_accept_encoding(header):
+
+    # content coding vs q value, e.g. "gzip;q=0" refuses gzip
+    accepted = {}
+    for token in header.split(","):
+        coding, *params = [part.strip() for part in token.split(";")]
+        if not coding:
+            continue
+
+        q = 1.0
+        for param in params:
+            name, _, value = param.partition("=")
+            if name.strip().lower() == "q":
+                try:
+                    q = float(value)
+                except ValueError:
+                    q = 0
+        accepted[coding.lower()] = q
+
+    return accepted
+
+
+def read_fund_csv(mfcode, extension):
+
+    # a compressed variant is only used if it is not older than the plain
+    # output, i.e. it was written by the same or a later run
+    pack_file = PACK_FILE + extension
+    if is_fresh(pack_file, PACK_FILE):
+        index = get_pack_index(pack_file)
+        if index is not None:
+            if mfcode not in index:
+                return None
+
+            offset, length = index[mfcode]
+            with open(pack_file, "rb") as f:
+                return os.pread(f.fileno(), length, offset)
+
+    csv_file = os.path.join(CSV_DIR, str(mfcode) + ".csv")
+    if is_fresh(csv_file + extension, csv_file):
+        with open(csv_file + extension, "rb") as f:
+            return f.read()
+
+    return None
+
+
+def is_fresh(file_name, plain_file_name):
+
+    try:
+        return os.stat(file_name).st_mtime >= \
+               os.stat(plain_file_name).st_mtime
+    except OSError:
+        return False
+
+
+def get_pack_index(pack_file):
+
+    try:
+        stat = os.stat(pack_file)
+    except OSError:
+        return None
+
+    key = (stat.st_ino, stat.st_mtime_ns, stat.st_size)
+    if pack_file in pack_index_cache and \
+       pack_index_cache[pack_file][0] == key:
+        return pack_index_cache[pack_file][1]
+
+    index = {}
+    with open(pack_file, "rb") as f:
+        f.seek(-PACK_TRAILER_SIZE, os.SEEK_END)
+        trailer = f.read(PACK_TRAILER_SIZE).decode().strip().split(",")
+        if trailer[0] != "MFPACK01":
+            return None
+
+        f.seek(int(trailer[1]))
+        for line in f.read(stat.st_size - PACK_TRAILER_SIZE - int(trailer[1]))\
+                     .decode().splitlines():
+            code, offset, length = line.split(",")
+            index[int(code)] = (int(offset), int(length))
+
+    pack_index_cache[pack_file] = (key, index)
+    return index
+
+
+@app.route('/api/series/<int:mfcode>')
+def api_series(mfcode):
+
+    return query_daemon("SERIES " + str(mfcode))
+
+
+@app.route('/api/snapshot')
+@app.route('/api/snapshot/<date>')
+def api_snapshot(date=None):
+
+    return query_daemon("SNAPSHOT" + (" " + date if date else ""))
+
+
+@app.route('/api/topk/<column>/<int:k>')
+def api_topk(column, k):
+
+    date = request.args.get("date")
+    return query_daemon("TOPK " + column + " " + str(k) +
+                        (" " + date if date else ""))
+
+
+def query_daemon(query):
+
+    # proxy a single line query to `downloader --daemon`, whose response is
+    # "OK\n<csv>" or "ERROR <reason>\n"
+    if "\n" in query:
+        abort(400)
+
+    try:
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+            s.settimeout(5)
+            s.connect(DAEMON_SOCKET)
+            s.sendall((query + "\n").encode())
+
+            chunks = []
+            while True:
+                chunk = s.recv(65536)
+                if not chunk:
+                    break
+                chunks.append(chunk)
+    except OSError:
+        abort(503)
+
+    status, _, body = b"".join(chunks).partition(b"\n")
+    if status == b"ERROR unknown mutual fund":
+        abort(404)
+    if status != b"OK":
+        abort(400)
+
+    return Response(body, mimetype="text/csv")
+
+
+@app.route('/search')
+def search():
+
+    # every word of the query must prefix some word of a scheme name, the
+    # word runs are found by binary search over the sorted name index
+    terms = split_words(request.args.get("term", ""))
+    words, codes = get_cached(NAME_INDEX_FILE, read_name_index)
+    names = get_cached(NAME_FILE, read_names)
+
+    matches = None
+    for term in terms:
+        term_matches = set()
+        i = bisect.bisect_left(words, term)
+        while i < len(words) and words[i].startswith(term):
+            term_matches.update(codes[i])
+            i += 1
+
+        matches = term_matches if matches is None else matches & term_matches
+        if not matches:
+            break
+
+    results = sorted(matches or [], key=int)[:MAX_SEARCH_RESULTS]
+    return jsonify([{"mfcode": code, "label": names[code]}
+                    for code in results if code in names])
+
+
+def split_words(text):
+
+    # lowercase ASCII alphanumeric runs, the same words as the name index
+    # written by the downloader, so "abn-amro" is "abn" and "amro"
+    words = []
+    word = ""
+    for c in text.lower() + " ":
+        if c.isascii() and c.isalnum():
+            word += c
+        elif word:
+            words.append(word)
+            word = ""
+
+    return words
+
+
+@app.route('/names')
+def scheme_names():
+
+    # labels for a comma separated list of codes
+    names = get_cached(NAME_FILE, read_names)
+    codes = request.args.get("codes", "").split(",")
+    return jsonify({code: names[code] for code in codes if code in names})
+
+
+def get_cached(file_name, reader):
+
+    try:
+        stat = os.stat(file_name)
+    except OSError:
+        abort(503)
+
+    key = (stat.st_ino, stat.st_mtime_ns, stat.st_size)
+    if file_name not in name_cache or name_cache[file_name][0] != key:
+        name_cache[file_name] = (key, reader(file_name))
+    return name_cache[file_name][1]
+
+
+def read_name_index(file_name):
+
+    words = []
+    codes = []
+    with open(file_name, "r") as f:
+        for line in f:
+            word, _, word_codes = line.rstrip("\n").partition(",")
+            words.append(word)
+            codes.append(word_codes.split())
 
+    return words, codes
 
-def get_mf_name_codes():
 
-    mf_name_codes = []
+def read_names(file_name):
 
-    file_name = os.path.join("static/csv", "mf_code_names.csv")
+    names = {}
     with open(file_name, "r") as f:
         csv_reader = csv.reader(f, delimiter=',')
         for row in csv_reader:
-            mf_name_codes.append(\
-                "{mfcode: \"" + row[0] + "\", label: \"" + row[1] + "\"}")
+            names[row[0]] = row[1]
 
-    return mf_name_codes
+    return names
 
 
 if __name__ == '__main__':
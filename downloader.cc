@@ -1,948 +1,6635 @@
 #include <boost/date_time/gregorian/gregorian.hpp>
+#include <brotli/encode.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <dirent.h>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <set>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 using namespace std;
 
-class MutualFundData
+#ifdef COUNT_ALLOCATIONS
+// every heap allocation made by the process, reported per stage by the
+// alloc-stats build
+atomic<unsigned long> gNumAllocations(0);
+
+void*
+operator new(size_t size)
 {
-public:
-  enum class TYPE
+  ++gNumAllocations;
+
+  void* p = malloc(size ? size : 1);
+  if (p == nullptr)
   {
-    NAV,
+    throw bad_alloc();
+  }
+  return p;
+}
 
-    ONE_MNTH_NAV_AVG,
+void
+operator delete(void* p) noexcept
+{
+  free(p);
+}
 
-    ONE_YR_NAV_CAGR,
-    THREE_YR_NAV_CAGR,
-    FIVE_YR_NAV_CAGR,
+void
+ReportAllocations(const string& stage)
+{
+  static unsigned long last_num_allocations = 0;
 
-    TWO_YR_VARIANCE_SUM_FOR_ONE_YR_NAV_CAGR,
-    FOUR_YR_VARIANCE_SUM_FOR_ONE_YR_NAV_CAGR,
-  };
+  unsigned long num_allocations = gNumAllocations;
+  cout << "Allocations during " << stage << ": "
+       << (num_allocations - last_num_allocations) << endl;
+  last_num_allocations = num_allocations;
+}
+#else
+void
+ReportAllocations(const string&)
+{
+}
+#endif
 
+class Arena
+{
 public:
-  MutualFundData(double nav)
-    : mpNav(new double(nav)),
-      mpOneMnthNavAvg(nullptr),
-      mpOneYrNavCagr(nullptr),
-      mpThreeYrNavCagr(nullptr),
-      mpFiveYrNavCagr(nullptr),
-      mpTwoYrVarSumForOneYrNavCagr(nullptr),
-      mpFourYrVarSumForOneYrNavCagr(nullptr)
+  // Bump allocator for data that lives exactly as long as one batch of
+  // mutual funds. Individual deallocations are no-ops, everything is
+  // released at once when the arena is destroyed.
+  Arena(size_t blockSize = 1 << 20)
+    : mBlockSize(blockSize),
+      mpCurrent(nullptr),
+      mpEnd(nullptr),
+      mBytesAllocated(0),
+      mNumNames(0)
   {
   }
 
-  MutualFundData(const MutualFundData &d)
-    : mpNav(new double(*d.mpNav)),
-      mpOneMnthNavAvg(nullptr),
-      mpOneYrNavCagr(nullptr),
-      mpThreeYrNavCagr(nullptr),
-      mpFiveYrNavCagr(nullptr),
-      mpTwoYrVarSumForOneYrNavCagr(nullptr),
-      mpFourYrVarSumForOneYrNavCagr(nullptr)
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  ~Arena()
   {
-    if (d.mpOneMnthNavAvg)
+    for (Name* name : mNameBuckets)
     {
-      mpOneMnthNavAvg = new double(*d.mpOneMnthNavAvg);
+      while (name != nullptr)
+      {
+        Name* next = name->mpNext;
+        name->~Name();
+        name = next;
+      }
+    }
+
+    for (char* block : mBlocks)
+    {
+      delete[] block;
     }
+  }
+
+  void* Allocate(size_t size, size_t alignment)
+  {
+    size_t padding = (alignment -
+      reinterpret_cast<uintptr_t>(mpCurrent) % alignment) % alignment;
 
-    if (d.mpOneYrNavCagr)
+    if (mpCurrent == nullptr ||
+        size + padding > static_cast<size_t>(mpEnd - mpCurrent))
     {
-      mpOneYrNavCagr = new double(*d.mpOneYrNavCagr);
+      size_t block_size = max(mBlockSize, size + alignment);
+      mBlocks.push_back(new char[block_size]);
+      mpCurrent = mBlocks.back();
+      mpEnd = mpCurrent + block_size;
+      padding = (alignment -
+        reinterpret_cast<uintptr_t>(mpCurrent) % alignment) % alignment;
     }
-    if (d.mpThreeYrNavCagr)
+
+    void* p = mpCurrent + padding;
+    mpCurrent += padding + size;
+    mBytesAllocated += size;
+    return p;
+  }
+
+  size_t BytesAllocated() const
+  {
+    return mBytesAllocated;
+  }
+
+  // The one copy in the arena of a scheme, category or AMC name, shared by
+  // every fund of the batch with that name, so a name is copied only the
+  // first time it is seen.
+  const string* Intern(const string& value)
+  {
+    const size_t hash = std::hash<string>()(value);
+    if (!mNameBuckets.empty())
     {
-      mpThreeYrNavCagr = new double(*d.mpThreeYrNavCagr);
+      for (Name* name = mNameBuckets[hash % mNameBuckets.size()];
+           name != nullptr;
+           name = name->mpNext)
+      {
+        if (name->mHash == hash && name->mValue == value)
+        {
+          return &name->mValue;
+        }
+      }
     }
-     if (d.mpFiveYrNavCagr)
+
+    if (mNumNames >= mNameBuckets.size())
     {
-      mpFiveYrNavCagr = new double(*d.mpFiveYrNavCagr);
+      RehashNames(max<size_t>(64, 2 * mNameBuckets.size()));
     }
 
-    if (d.mpTwoYrVarSumForOneYrNavCagr)
+    Name* name = new (Allocate(sizeof(Name), alignof(Name))) Name(value, hash);
+    Name*& bucket = mNameBuckets[hash % mNameBuckets.size()];
+    name->mpNext = bucket;
+    bucket = name;
+    ++mNumNames;
+    return &name->mValue;
+  }
+
+private:
+  struct Name
+  {
+    Name(const string& value, size_t hash)
+      : mValue(value),
+        mHash(hash),
+        mpNext(nullptr)
     {
-      mpTwoYrVarSumForOneYrNavCagr =
-        new double(*d.mpTwoYrVarSumForOneYrNavCagr);
     }
-    if (d.mpFourYrVarSumForOneYrNavCagr)
+
+    string mValue;
+    size_t mHash;
+    Name* mpNext;
+  };
+
+  void RehashNames(size_t numBuckets)
+  {
+    vector<Name*> buckets(numBuckets, nullptr);
+    for (Name* name : mNameBuckets)
     {
-      mpFourYrVarSumForOneYrNavCagr =
-        new double(*d.mpFourYrVarSumForOneYrNavCagr);
+      while (name != nullptr)
+      {
+        Name* next = name->mpNext;
+        name->mpNext = buckets[name->mHash % numBuckets];
+        buckets[name->mHash % numBuckets] = name;
+        name = next;
+      }
     }
+    mNameBuckets.swap(buckets);
+  }
+
+private:
+  size_t mBlockSize;
+  vector<char*> mBlocks;
+  char* mpCurrent;
+  char* mpEnd;
+  size_t mBytesAllocated;
+
+  // the interned names, chained in buckets by hash
+  vector<Name*> mNameBuckets;
+  size_t mNumNames;
+};
+
+template <class T>
+class ArenaAllocator
+{
+public:
+  typedef T value_type;
+
+  ArenaAllocator(Arena& arena)
+    : mpArena(&arena)
+  {
+  }
+
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U>& other)
+    : mpArena(other.mpArena)
+  {
   }
 
-  ~MutualFundData()
+  T* allocate(size_t n)
   {
-    delete mpNav;
+    return static_cast<T*>(mpArena->Allocate(n * sizeof(T), alignof(T)));
+  }
 
-    delete mpOneMnthNavAvg;
+  void deallocate(T*, size_t)
+  {
+  }
 
-    delete mpOneYrNavCagr;
-    delete mpThreeYrNavCagr;
-    delete mpFiveYrNavCagr;
+  template <class U>
+  bool operator==(const ArenaAllocator<U>& other) const
+  {
+    return mpArena == other.mpArena;
+  }
 
-    delete mpTwoYrVarSumForOneYrNavCagr;
-    delete mpFourYrVarSumForOneYrNavCagr;
+  template <class U>
+  bool operator!=(const ArenaAllocator<U>& other) const
+  {
+    return mpArena != other.mpArena;
   }
 
-  MutualFundData& operator=(const MutualFundData&) = delete;
+public:
+  Arena* mpArena;
+};
 
-  const double* Get(TYPE type) const
+class DailyColumn
+{
+public:
+  enum class ENCODING
   {
-    switch (type)
+    DOUBLE,
+    SCALED_INT,
+    FLOAT
+  };
+
+public:
+  // The values of consecutive calendar days from the first day the value is
+  // available for, stored as doubles or, once compacted, as integers of
+  // 1/10000 or as floats of values of 4 decimals, and read back as doubles
+  // either way.
+  DailyColumn()
+    : mFirstDay(0),
+      mEncoding(ENCODING::DOUBLE)
+  {
+  }
+
+  void Assign(size_t firstDay, const vector<double>& values)
+  {
+    mFirstDay = firstDay;
+    mEncoding = ENCODING::DOUBLE;
+    vector<double>(values).swap(mDoubles);
+    vector<int32_t>().swap(mScaled);
+    vector<float>().swap(mFloats);
+  }
+
+  size_t FirstDay() const
+  {
+    return mFirstDay;
+  }
+
+  size_t EndDay() const
+  {
+    return mFirstDay + Size();
+  }
+
+  bool Has(size_t day) const
+  {
+    return day >= mFirstDay && day < EndDay();
+  }
+
+  // the value of a day the column has
+  double operator[](size_t day) const
+  {
+    switch (mEncoding)
     {
-      case TYPE::NAV:
-        return mpNav;
+      case ENCODING::SCALED_INT:
+        return mScaled[day - mFirstDay] / SCALE;
 
-      case TYPE::ONE_MNTH_NAV_AVG:
-        return mpOneMnthNavAvg;
+      case ENCODING::FLOAT:
+        return round(mFloats[day - mFirstDay] * SCALE) / SCALE;
+
+      default:
+        return mDoubles[day - mFirstDay];
+    }
+  }
+
+  ENCODING Encoding() const
+  {
+    return mEncoding;
+  }
+
+  // heap memory of the values
+  size_t Bytes() const
+  {
+    return mDoubles.capacity() * sizeof(double) +
+           mScaled.capacity() * sizeof(int32_t) +
+           mFloats.capacity() * sizeof(float);
+  }
+
+  // Stores the values in the given encoding if every one of them reads
+  // back as the value written to the csv files, i.e. printed at 4 decimals
+  // and parsed again, or if exact, as the value itself, which is then one
+  // of 4 decimals, e.g. for the NAVs the statistics are calculated from.
+  // Otherwise the column stays as doubles.
+  bool Compact(ENCODING encoding, bool exact)
+  {
+    if (mEncoding != ENCODING::DOUBLE || encoding == ENCODING::DOUBLE)
+    {
+      return mEncoding == encoding;
+    }
+
+    vector<int32_t> scaled_values;
+    vector<float> float_values;
+    if (encoding == ENCODING::SCALED_INT)
+    {
+      scaled_values.reserve(mDoubles.size());
+    }
+    else
+    {
+      float_values.reserve(mDoubles.size());
+    }
+
+    for (double value : mDoubles)
+    {
+      const double written = exact ? value : Written(value);
+
+      double compact_value;
+      if (encoding == ENCODING::SCALED_INT)
+      {
+        // NaN fails the range check too
+        const double scaled_value = round(written * SCALE);
+        if (!(scaled_value > numeric_limits<int32_t>::min() &&
+              scaled_value <= numeric_limits<int32_t>::max()))
+        {
+          return false;
+        }
+        scaled_values.push_back(static_cast<int32_t>(scaled_value));
+        compact_value = scaled_values.back() / SCALE;
+      }
+      else
+      {
+        float_values.push_back(static_cast<float>(written));
+        compact_value = round(float_values.back() * SCALE) / SCALE;
+      }
+
+      // a NaN statistic reads back as NaN
+      if (compact_value != written &&
+          !(std::isnan(compact_value) && std::isnan(written)))
+      {
+        return false;
+      }
+    }
+
+    mScaled.swap(scaled_values);
+    mFloats.swap(float_values);
+    vector<double>().swap(mDoubles);
+    mEncoding = encoding;
+    return true;
+  }
+
+  // the doubles as written to the csv files, which every encoding then
+  // reads back the same
+  void RoundToWritten()
+  {
+    for (double& value : mDoubles)
+    {
+      value = Written(value);
+    }
+  }
+
+private:
+  static double Written(double value)
+  {
+    char text[64];
+    snprintf(text, sizeof(text), "%.4f", value);
+    return strtod(text, nullptr);
+  }
 
-      case TYPE::ONE_YR_NAV_CAGR:
-        return mpOneYrNavCagr;
-      case TYPE::THREE_YR_NAV_CAGR:
-        return mpThreeYrNavCagr;
-      case TYPE::FIVE_YR_NAV_CAGR:
-        return mpFiveYrNavCagr;
+  size_t Size() const
+  {
+    switch (mEncoding)
+    {
+      case ENCODING::SCALED_INT:
+        return mScaled.size();
 
-      case TYPE::TWO_YR_VARIANCE_SUM_FOR_ONE_YR_NAV_CAGR:
-        return mpTwoYrVarSumForOneYrNavCagr;
-      case TYPE::FOUR_YR_VARIANCE_SUM_FOR_ONE_YR_NAV_CAGR:
-        return mpFourYrVarSumForOneYrNavCagr;
+      case ENCODING::FLOAT:
+        return mFloats.size();
 
       default:
-        assert(false);
+        return mDoubles.size();
     }
   }
 
-  void Set(TYPE type, double val)
+private:
+  static constexpr double SCALE = 10000.0;
+
+  size_t mFirstDay;
+  ENCODING mEncoding;
+
+  // only the one of the encoding is used
+  vector<double> mDoubles;
+  vector<int32_t> mScaled;
+  vector<float> mFloats;
+};
+
+class MutualFundData
+{
+public:
+  enum class TYPE
+  {
+    NAV,
+
+    ONE_MNTH_NAV_AVG,
+
+    ONE_YR_NAV_CAGR,
+    THREE_YR_NAV_CAGR,
+    FIVE_YR_NAV_CAGR,
+
+    TWO_YR_STD_DEV_OF_ONE_YR_NAV_CAGR,
+    FOUR_YR_STD_DEV_OF_ONE_YR_NAV_CAGR,
+
+    NUM_TYPES
+  };
+
+  static const size_t NUM_TYPES = static_cast<size_t>(TYPE::NUM_TYPES);
+
+public:
+  // The NAV and statistics of a fund for every calendar day from
+  // mFirstDate, one contiguous column each. The NAV column covers every day
+  // and the statistics the days they are available for.
+  MutualFundData()
+    : mNumDays(0)
+  {
+  }
+
+  const DailyColumn& Get(TYPE type) const
+  {
+    return mColumns[static_cast<size_t>(type)];
+  }
+
+  DailyColumn& Get(TYPE type)
+  {
+    return mColumns[static_cast<size_t>(type)];
+  }
+
+  boost::gregorian::date LastDate() const
+  {
+    return mFirstDate + boost::gregorian::date_duration(mNumDays - 1);
+  }
+
+  // The compact storage of a column: the NAVs as integers of 1/10000 where
+  // that is exact, since the statistics are calculated from them, the 1
+  // month average the same where it reads back as written to the csv files,
+  // as NAVs need more significant digits than a float has, and the other
+  // statistics, which are percentages, as floats where they read back as
+  // written.
+  void Compact(TYPE type)
   {
+    DailyColumn& column = Get(type);
     switch (type)
     {
-      case TYPE::ONE_MNTH_NAV_AVG:
-        mpOneMnthNavAvg = new double(val);
-        break;
-
-      case TYPE::ONE_YR_NAV_CAGR:
-        mpOneYrNavCagr = new double(val);
-        break;
-      case TYPE::THREE_YR_NAV_CAGR:
-        mpThreeYrNavCagr = new double(val);
-        break;
-      case TYPE::FIVE_YR_NAV_CAGR:
-        mpFiveYrNavCagr = new double(val);
+      case TYPE::NAV:
+        column.Compact(DailyColumn::ENCODING::SCALED_INT, true);
         break;
 
-      case TYPE::TWO_YR_VARIANCE_SUM_FOR_ONE_YR_NAV_CAGR:
-        mpTwoYrVarSumForOneYrNavCagr = new double(val);
-        break;
-      case TYPE::FOUR_YR_VARIANCE_SUM_FOR_ONE_YR_NAV_CAGR:
-        mpFourYrVarSumForOneYrNavCagr = new double(val);
+      case TYPE::ONE_MNTH_NAV_AVG:
+        column.Compact(DailyColumn::ENCODING::SCALED_INT, false);
         break;
 
       default:
-        assert(false);
+        column.Compact(DailyColumn::ENCODING::FLOAT, false);
+        break;
     }
   }
 
-private:
-  double* mpNav;
+  // heap memory of the values
+  size_t Bytes() const
+  {
+    size_t bytes = 0;
+    for (auto& column : mColumns)
+    {
+      bytes += column.Bytes();
+    }
+    return bytes;
+  }
 
-  double* mpOneMnthNavAvg;
+  // the line of the day in the fund's csv file, without the line end
+  void FormatRow(ostream& out, size_t day) const
+  {
+    out << to_iso_extended_string(
+        mFirstDate + boost::gregorian::date_duration(day));
+    for (auto& column : mColumns)
+    {
+      out << ",";
+      if (column.Has(day))
+      {
+        out << column[day];
+      }
+    }
+  }
 
-  double* mpOneYrNavCagr;
-  double* mpThreeYrNavCagr;
-  double* mpFiveYrNavCagr;
+public:
+  boost::gregorian::date mFirstDate;
+  size_t mNumDays;
 
-  double* mpTwoYrVarSumForOneYrNavCagr;
-  double* mpFourYrVarSumForOneYrNavCagr;
+private:
+  DailyColumn mColumns[NUM_TYPES];
 };
 
 class MutualFund
 {
+public:
+  // the NAVs as read, whose map nodes are allocated from the batch's arena
+  typedef map<boost::gregorian::date,
+              double,
+              less<boost::gregorian::date>,
+              ArenaAllocator<pair<const boost::gregorian::date,
+                                  double>>> NavMap;
+
 public:
   MutualFund(long code,
              const string& name,
-             const boost::gregorian::date& date,
-             const MutualFundData& data)
+             Arena& arena)
     : mCode(code),
-      mName(name)
+      mName(arena.Intern(name)),
+      mCategory(arena.Intern("")),
+      mAmc(mCategory),
+      mNavs(less<boost::gregorian::date>(),
+            ArenaAllocator<NavMap::value_type>(arena))
   {
-    mData.insert(make_pair(date, data));
   }
 
+  MutualFund(MutualFund&&) = default;
+
+  MutualFund(const MutualFund&) = delete;
+  MutualFund& operator=(const MutualFund&) = delete;
+
 public:
   long mCode;
-  string mName;
-  map<boost::gregorian::date, MutualFundData> mData;
-};
 
-vector<string>
-GetNavFileNames(const string& parentDir)
-{
-  vector<string> file_names;
+  // interned in the arena of the batch
+  const string* mName;
+  const string* mCategory;
+  const string* mAmc;
 
-  struct dirent* dir;
-  DIR* dirp = opendir(parentDir.c_str());
+  NavMap mNavs;
 
-  if (dirp)
+  // filled from mNavs by AddMissingDates and CalculateStatistics
+  MutualFundData mData;
+};
+
+string
+ToSlug(const string& str)
+{
+  // "Open Ended Schemes ( Income )" -> "open_ended_schemes_income"
+  string slug;
+  for (char c : str)
   {
-    while ((dir = readdir(dirp)) != 0)
+    if (isalnum(static_cast<unsigned char>(c)))
     {
-      if (strcmp(dir->d_name, ".") && strcmp(dir->d_name, ".."))
-      {
-        file_names.push_back(parentDir + "/" + dir->d_name);
-      }
+      slug += tolower(static_cast<unsigned char>(c));
+    }
+    else if (!slug.empty() && slug.back() != '_')
+    {
+      slug += '_';
     }
-
-    closedir(dirp);
   }
 
-  return file_names;
+  if (!slug.empty() && slug.back() == '_')
+  {
+    slug.pop_back();
+  }
+  return slug;
 }
 
-vector<string>
-Split(const string& str, const string& delimiter)
+class Options
 {
-  size_t pos_start = 0, pos_end, delim_len = delimiter.length();
-
-  string token;
-  vector<string> res;
+public:
+  Options()
+    : mNumThreads(max(1u, thread::hardware_concurrency())),
+      mCorrEnabled(false),
+      mCorrAllFunds(false),
+      mCorrFrom(boost::gregorian::neg_infin),
+      mCorrTo(boost::gregorian::pos_infin),
+      mCorrBinary(false),
+      mWriteCsvFiles(true),
+      mWritePack(false),
+      mGzip(false),
+      mBrotli(false),
+      mCategoryStats(false),
+      mSipXirr(false),
+      mSipWindowMonths({ 36, 60 }),
+      mUseUring(false),
+      mIoBenchmark(false),
+      mDaemon(false),
+      mSocketPath("downloader.sock"),
+      mStreamJobs(4),
+      mStreamFrom(2006, 4, 1),
+      mStreamTo(boost::gregorian::date(
+          boost::gregorian::day_clock::local_day().year(),
+          boost::gregorian::day_clock::local_day().month(), 1) -
+        boost::gregorian::days(1)),
+      mBacktest(false),
+      mBacktestRanks({ "3y_cagr" }),
+      mBacktestRisks({ "none", "2y_sd" }),
+      mBacktestHoldings({ 10 }),
+      mBacktestMonths({ 1, 12, 0 }),
+      mBuildIndex(false),
+      mShard(0),
+      mNumShards(0),
+      mMergeShards(0),
+      mCompactColumns(false),
+      mVerifyStorage(false)
+  {
+  }
 
-  while ((pos_end = str.find(delimiter, pos_start)) != string::npos)
+  bool IsCorrFund(const MutualFund& mf) const
   {
-    token = str.substr(pos_start, pos_end - pos_start);
-    pos_start = pos_end + delim_len;
-    res.push_back(token);
+    return mCorrEnabled &&
+      (mCorrAllFunds ||
+       mCorrCodes.find(mf.mCode) != mCorrCodes.end() ||
+       (!mCorrCategory.empty() && ToSlug(*mf.mCategory) == mCorrCategory));
   }
 
-  res.push_back(str.substr(pos_start));
-  return res;
-}
+public:
+  unsigned mNumThreads;
+
+  // cross-fund correlation of daily returns
+  bool mCorrEnabled;
+  bool mCorrAllFunds;
+  set<long> mCorrCodes;
+  string mCorrCategory;
+  boost::gregorian::date mCorrFrom;
+  boost::gregorian::date mCorrTo;
+  bool mCorrBinary;
+
+  // per fund csv files and/or a single packed file with an index
+  bool mWriteCsvFiles;
+  bool mWritePack;
+
+  // precompressed variants of the above for serving
+  bool mGzip;
+  bool mBrotli;
+
+  // per category aggregates and percentile ranks
+  bool mCategoryStats;
+
+  // rolling SIP XIRR distribution for these SIP lengths
+  bool mSipXirr;
+  vector<int> mSipWindowMonths;
+
+  // NAV file reads and csv file writes through io_uring
+  bool mUseUring;
+  bool mIoBenchmark;
+
+  // resident mode serving queries from memory
+  bool mDaemon;
+  string mSocketPath;
+
+  // NAV reports parsed as they are fetched, "-" for stdin
+  string mStreamSource;
+  unsigned mStreamJobs;
+  boost::gregorian::date mStreamFrom;
+  boost::gregorian::date mStreamTo;
+
+  // screening rule variants, every combination of these is backtested
+  bool mBacktest;
+  vector<string> mBacktestRanks;
+  vector<string> mBacktestRisks;
+  vector<int> mBacktestHoldings;
+  vector<int> mBacktestMonths;
+
+  // one of mNumShards slices of the MF codes, read through the per file
+  // code indexes and later merged by a run with mMergeShards
+  bool mBuildIndex;
+  unsigned mShard;
+  unsigned mNumShards;
+  unsigned mMergeShards;
+
+  // the NAVs and statistics of each batch stored as scaled integers and
+  // floats, and the check that a run writes the same files with them
+  bool mCompactColumns;
+  bool mVerifyStorage;
+};
 
-stringstream
-ReadAllNavFiles(const vector<string>& fileNames)
+class ReturnMatrix
 {
-  cout << "Reading " << fileNames.size() << " NAV files" << endl;
+public:
+  ReturnMatrix()
+    : mFirstDate(boost::gregorian::not_a_date_time),
+      mNumDays(0)
+  {
+  }
 
-  stringstream raw_mf_data;
-  for (size_t i = 0; i < fileNames.size(); ++i)
+  double Get(size_t fund, size_t day) const
   {
-    ifstream in(fileNames.at(i).c_str());
-    raw_mf_data << in.rdbuf();
-    in.close();
+    return mReturns[fund * mNumDays + day];
   }
 
-  cout << "Read " << fileNames.size() << " NAV files" << endl;
+public:
+  // funds x days, row major, NaN where the fund has no return for the day
+  vector<long> mCodes;
+  boost::gregorian::date mFirstDate;
+  size_t mNumDays;
+  vector<double> mReturns;
+};
 
-  return raw_mf_data;
+class FileIo
+{
+public:
+  // Whole file reads and writes for the NAV files and the per fund csv
+  // files, with the number of system calls and the time spent in them.
+  // Writes may be queued until Flush().
+  FileIo()
+    : mNumSyscalls(0),
+      mReadMicros(0),
+      mWriteMicros(0)
+  {
+  }
+
+  virtual ~FileIo()
+  {
+  }
+
+  FileIo(const FileIo&) = delete;
+  FileIo& operator=(const FileIo&) = delete;
+
+  virtual const char* Name() const = 0;
+
+  void ReadFiles(const vector<string>& fileNames, vector<string>& contents)
+  {
+    auto start = chrono::steady_clock::now();
+    contents.assign(fileNames.size(), string());
+    DoReadFiles(fileNames, contents);
+    mReadMicros += chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now() - start).count();
+  }
+
+  void WriteFile(const string& fileName, const string& data)
+  {
+    auto start = chrono::steady_clock::now();
+    DoWriteFile(fileName, data);
+    mWriteMicros += chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now() - start).count();
+  }
+
+  void Flush()
+  {
+    auto start = chrono::steady_clock::now();
+    DoFlush();
+    mWriteMicros += chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now() - start).count();
+  }
+
+  // the most recent writes, which are not written until a flush
+  virtual size_t NumQueuedWrites() const
+  {
+    return 0;
+  }
+
+  void PrintStats(const string& prefix) const
+  {
+    cout << prefix << Name() << ": "
+         << mNumSyscalls << " syscalls, "
+         << mReadMicros / 1000 << "ms reading, "
+         << mWriteMicros / 1000 << "ms writing" << endl;
+  }
+
+protected:
+  virtual void DoReadFiles(const vector<string>& fileNames,
+                           vector<string>& contents) = 0;
+  virtual void DoWriteFile(const string& fileName, const string& data) = 0;
+  virtual void DoFlush() = 0;
+
+  bool PosixReadFile(const string& fileName, string& content)
+  {
+    char buffer[1 << 16];
+
+    ++mNumSyscalls;
+    int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      return false;
+    }
+
+    ssize_t len;
+    while (++mNumSyscalls, (len = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+      content.append(buffer, len);
+    }
+
+    ++mNumSyscalls;
+    close(fd);
+    return len == 0;
+  }
+
+  bool PosixWriteFile(const string& fileName, const string& data)
+  {
+    ++mNumSyscalls;
+    int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    if (fd < 0)
+    {
+      return false;
+    }
+
+    size_t written = 0;
+    while (written < data.size())
+    {
+      ++mNumSyscalls;
+      ssize_t len = write(fd, data.data() + written, data.size() - written);
+      if (len <= 0)
+      {
+        break;
+      }
+      written += len;
+    }
+
+    ++mNumSyscalls;
+    close(fd);
+    return written == data.size();
+  }
+
+protected:
+  long mNumSyscalls;
+  long mReadMicros;
+  long mWriteMicros;
+};
+
+class PosixIo : public FileIo
+{
+public:
+  const char* Name() const override
+  {
+    return "posix";
+  }
+
+protected:
+  void DoReadFiles(const vector<string>& fileNames,
+                   vector<string>& contents) override
+  {
+    for (size_t i = 0; i < fileNames.size(); ++i)
+    {
+      if (!PosixReadFile(fileNames[i], contents[i]))
+      {
+        cout << "Failed to read " << fileNames[i] << endl;
+      }
+    }
+  }
+
+  void DoWriteFile(const string& fileName, const string& data) override
+  {
+    if (!PosixWriteFile(fileName, data))
+    {
+      cout << "Failed to write " << fileName << endl;
+    }
+  }
+
+  void DoFlush() override
+  {
+  }
+};
+
+class UringIo : public FileIo
+{
+public:
+  // io_uring without liburing. Opens go straight into a table of registered
+  // (direct) file slots so that open, read/write and close of a file can be
+  // submitted together, and all data moves through one registered buffer
+  // so the kernel does not map user pages per request. Reads are done in
+  // rounds of one chunk per open file, writes are queued and submitted as
+  // linked open -> write -> close chains, many files per io_uring_enter.
+  // Anything the kernel rejects is redone with plain POSIX calls.
+  static unique_ptr<FileIo> Create()
+  {
+    unique_ptr<UringIo> io(new UringIo());
+    if (!io->Setup())
+    {
+      cout << "io_uring is not available, using POSIX I/O" << endl;
+      return unique_ptr<FileIo>(new PosixIo());
+    }
+    return unique_ptr<FileIo>(io.release());
+  }
+
+  ~UringIo() override
+  {
+    if (mRingFd >= 0)
+    {
+      DoFlush();
+      close(mRingFd);
+    }
+    if (mpSqesMap != MAP_FAILED)
+    {
+      munmap(mpSqesMap, mSqesSize);
+    }
+    if (mpRing != MAP_FAILED)
+    {
+      munmap(mpRing, mRingSize);
+    }
+    free(mpBuffer);
+  }
+
+  const char* Name() const override
+  {
+    return "io_uring";
+  }
+
+  size_t NumQueuedWrites() const override
+  {
+    return mPendingWrites.size();
+  }
+
+protected:
+  void DoReadFiles(const vector<string>& fileNames,
+                   vector<string>& contents) override
+  {
+    for (size_t begin = 0; begin < fileNames.size(); begin += NUM_SLOTS)
+    {
+      const size_t end = min(begin + NUM_SLOTS, fileNames.size());
+      const size_t num_files = end - begin;
+
+      vector<bool> failed(num_files, false);
+      for (size_t i = 0; i < num_files; ++i)
+      {
+        io_uring_sqe* sqe = GetSqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(fileNames[begin + i].c_str());
+        // direct descriptors are never inherited, O_CLOEXEC is rejected
+        sqe->open_flags = O_RDONLY;
+        sqe->file_index = i + 1;
+        sqe->user_data = i;
+      }
+      SubmitAndWait(num_files, [&](uint64_t i, int res)
+      {
+        failed[i] = res < 0;
+      });
+
+      // every open file reads its next chunk into its own part of the
+      // registered buffer until it hits end of file
+      const size_t chunk_size = BUFFER_SIZE / num_files;
+      vector<uint64_t> offsets(num_files, 0);
+      vector<bool> done(failed);
+      while (true)
+      {
+        size_t num_reads = 0;
+        for (size_t i = 0; i < num_files; ++i)
+        {
+          if (done[i])
+          {
+            continue;
+          }
+
+          io_uring_sqe* sqe = GetSqe();
+          sqe->opcode = IORING_OP_READ_FIXED;
+          sqe->flags = IOSQE_FIXED_FILE;
+          sqe->fd = i;
+          sqe->addr = reinterpret_cast<uint64_t>(mpBuffer + i * chunk_size);
+          sqe->len = chunk_size;
+          sqe->off = offsets[i];
+          sqe->buf_index = 0;
+          sqe->user_data = i;
+          ++num_reads;
+        }
+
+        if (num_reads == 0)
+        {
+          break;
+        }
+
+        SubmitAndWait(num_reads, [&](uint64_t i, int res)
+        {
+          if (res <= 0)
+          {
+            done[i] = true;
+            failed[i] = res < 0;
+            return;
+          }
+          contents[begin + i].append(mpBuffer + i * chunk_size, res);
+          offsets[i] += res;
+        });
+      }
+
+      for (size_t i = 0; i < num_files; ++i)
+      {
+        io_uring_sqe* sqe = GetSqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = i + 1;
+        sqe->user_data = i;
+      }
+      SubmitAndWait(num_files, [](uint64_t, int) {});
+
+      for (size_t i = 0; i < num_files; ++i)
+      {
+        if (failed[i])
+        {
+          contents[begin + i].clear();
+          if (!PosixReadFile(fileNames[begin + i], contents[begin + i]))
+          {
+            cout << "Failed to read " << fileNames[begin + i] << endl;
+          }
+        }
+      }
+    }
+  }
+
+  void DoWriteFile(const string& fileName, const string& data) override
+  {
+    if (data.size() > BUFFER_SIZE)
+    {
+      // after the queued ones, so the files are written in order
+      DoFlush();
+      DoWriteFilePosix(fileName, data);
+      return;
+    }
+
+    if (mPendingWrites.size() == NUM_SLOTS ||
+        mBufferUsed + data.size() > BUFFER_SIZE)
+    {
+      DoFlush();
+    }
+
+    memcpy(mpBuffer + mBufferUsed, data.data(), data.size());
+    mPendingWrites.push_back(make_tuple(fileName, mBufferUsed, data.size()));
+    mBufferUsed += data.size();
+  }
+
+  void DoFlush() override
+  {
+    if (mPendingWrites.empty())
+    {
+      return;
+    }
+
+    for (size_t i = 0; i < mPendingWrites.size(); ++i)
+    {
+      const string& file_name = get<0>(mPendingWrites[i]);
+
+      io_uring_sqe* sqe = GetSqe();
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = reinterpret_cast<uint64_t>(file_name.c_str());
+      sqe->len = 0644;
+      sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+      sqe->file_index = i + 1;
+      sqe->user_data = i * 3;
+
+      sqe = GetSqe();
+      sqe->opcode = IORING_OP_WRITE_FIXED;
+      sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+      sqe->fd = i;
+      sqe->addr = reinterpret_cast<uint64_t>(
+          mpBuffer + get<1>(mPendingWrites[i]));
+      sqe->len = get<2>(mPendingWrites[i]);
+      sqe->off = 0;
+      sqe->buf_index = 0;
+      sqe->user_data = i * 3 + 1;
+
+      sqe = GetSqe();
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->file_index = i + 1;
+      sqe->user_data = i * 3 + 2;
+    }
+
+    vector<bool> failed(mPendingWrites.size(), false);
+    SubmitAndWait(mPendingWrites.size() * 3, [&](uint64_t data, int res)
+    {
+      size_t i = data / 3;
+      if (res < 0 ||
+          (data % 3 == 1 &&
+           static_cast<size_t>(res) != get<2>(mPendingWrites[i])))
+      {
+        failed[i] = true;
+      }
+    });
+
+    for (size_t i = 0; i < mPendingWrites.size(); ++i)
+    {
+      if (failed[i])
+      {
+        DoWriteFilePosix(get<0>(mPendingWrites[i]),
+                         string(mpBuffer + get<1>(mPendingWrites[i]),
+                                get<2>(mPendingWrites[i])));
+      }
+    }
+
+    mPendingWrites.clear();
+    mBufferUsed = 0;
+  }
+
+private:
+  static const size_t NUM_SLOTS = 64;
+  static const size_t NUM_ENTRIES = NUM_SLOTS * 4;
+  static const size_t BUFFER_SIZE = 16 << 20;
+
+  UringIo()
+    : mRingFd(-1),
+      mpRing(MAP_FAILED),
+      mRingSize(0),
+      mpSqesMap(MAP_FAILED),
+      mSqesSize(0),
+      mpSqes(nullptr),
+      mpBuffer(nullptr),
+      mBufferUsed(0),
+      mSqTail(0),
+      mToSubmit(0)
+  {
+  }
+
+  bool Setup()
+  {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ++mNumSyscalls;
+    mRingFd = syscall(__NR_io_uring_setup, NUM_ENTRIES, &params);
+    if (mRingFd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+      return false;
+    }
+
+    mRingSize = max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                    params.cq_off.cqes +
+                    params.cq_entries * sizeof(io_uring_cqe));
+    mpRing = mmap(nullptr, mRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQ_RING);
+    mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    mpSqesMap = mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQES);
+    if (mpRing == MAP_FAILED || mpSqesMap == MAP_FAILED)
+    {
+      return false;
+    }
+    mpSqes = static_cast<io_uring_sqe*>(mpSqesMap);
+
+    char* ring = static_cast<char*>(mpRing);
+    mpSqHead = reinterpret_cast<unsigned*>(ring + params.sq_off.head);
+    mpSqTail = reinterpret_cast<unsigned*>(ring + params.sq_off.tail);
+    mSqMask = *reinterpret_cast<unsigned*>(ring + params.sq_off.ring_mask);
+    mSqEntries = params.sq_entries;
+    mpSqArray = reinterpret_cast<unsigned*>(ring + params.sq_off.array);
+    mpCqHead = reinterpret_cast<unsigned*>(ring + params.cq_off.head);
+    mpCqTail = reinterpret_cast<unsigned*>(ring + params.cq_off.tail);
+    mCqMask = *reinterpret_cast<unsigned*>(ring + params.cq_off.ring_mask);
+    mpCqes = reinterpret_cast<io_uring_cqe*>(ring + params.cq_off.cqes);
+    mSqTail = *mpSqTail;
+
+    if (posix_memalign(reinterpret_cast<void**>(&mpBuffer), 4096,
+                       BUFFER_SIZE) != 0)
+    {
+      mpBuffer = nullptr;
+      return false;
+    }
+
+    iovec iov = { mpBuffer, BUFFER_SIZE };
+    ++mNumSyscalls;
+    if (syscall(__NR_io_uring_register, mRingFd, IORING_REGISTER_BUFFERS,
+                &iov, 1) < 0)
+    {
+      return false;
+    }
+
+    // a sparse table, the slots are filled by direct opens
+    vector<int> files(NUM_SLOTS, -1);
+    ++mNumSyscalls;
+    if (syscall(__NR_io_uring_register, mRingFd, IORING_REGISTER_FILES,
+                files.data(), files.size()) < 0)
+    {
+      return false;
+    }
+
+    return true;
+  }
+
+  io_uring_sqe* GetSqe()
+  {
+    if (mSqTail - __atomic_load_n(mpSqHead, __ATOMIC_ACQUIRE) == mSqEntries)
+    {
+      throw runtime_error("io_uring submission queue is full");
+    }
+
+    unsigned index = mSqTail & mSqMask;
+    io_uring_sqe* sqe = &mpSqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    mpSqArray[index] = index;
+
+    ++mSqTail;
+    ++mToSubmit;
+    return sqe;
+  }
+
+  void SubmitAndWait(size_t numCompletions,
+                     const function<void(uint64_t, int)>& onCompletion)
+  {
+    __atomic_store_n(mpSqTail, mSqTail, __ATOMIC_RELEASE);
+
+    size_t completed = 0;
+    while (completed < numCompletions)
+    {
+      ++mNumSyscalls;
+      int ret = syscall(__NR_io_uring_enter, mRingFd, mToSubmit,
+                        numCompletions - completed, IORING_ENTER_GETEVENTS,
+                        nullptr, 0);
+      if (ret < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        throw runtime_error("io_uring_enter failed");
+      }
+      mToSubmit -= min<size_t>(ret, mToSubmit);
+
+      unsigned head = *mpCqHead;
+      unsigned tail = __atomic_load_n(mpCqTail, __ATOMIC_ACQUIRE);
+      for (; head != tail; ++head, ++completed)
+      {
+        const io_uring_cqe& cqe = mpCqes[head & mCqMask];
+        onCompletion(cqe.user_data, cqe.res);
+      }
+      __atomic_store_n(mpCqHead, head, __ATOMIC_RELEASE);
+    }
+  }
+
+  void DoWriteFilePosix(const string& fileName, const string& data)
+  {
+    if (!PosixWriteFile(fileName, data))
+    {
+      cout << "Failed to write " << fileName << endl;
+    }
+  }
+
+private:
+  int mRingFd;
+  void* mpRing;
+  size_t mRingSize;
+  void* mpSqesMap;
+  size_t mSqesSize;
+  io_uring_sqe* mpSqes;
+
+  unsigned* mpSqHead;
+  unsigned* mpSqTail;
+  unsigned mSqMask;
+  unsigned mSqEntries;
+  unsigned* mpSqArray;
+  unsigned* mpCqHead;
+  unsigned* mpCqTail;
+  unsigned mCqMask;
+  io_uring_cqe* mpCqes;
+
+  char* mpBuffer;
+  size_t mBufferUsed;
+  vector<tuple<string, size_t, size_t>> mPendingWrites;
+
+  unsigned mSqTail;
+  unsigned mToSubmit;
+};
+
+unique_ptr<FileIo>
+CreateFileIo(bool useUring)
+{
+  if (useUring)
+  {
+    return UringIo::Create();
+  }
+  return unique_ptr<FileIo>(new PosixIo());
 }
 
-tuple<long, long>
-ReadMFCode(stringstream& rawMfData)
+vector<string>
+GetNavFileNames(const string& parentDir)
 {
-  cout << "Reading MF Data for minimum and maximum MF Code values" << endl;
+  vector<string> file_names;
 
-  set<long> mf_codes;
-  string line;
+  struct dirent* dir;
+  DIR* dirp = opendir(parentDir.c_str());
 
-  rawMfData.clear();
-  rawMfData.seekg(0, rawMfData.beg);
-  while (getline(rawMfData, line))
+  if (dirp)
   {
-    if (line.size() > 0)
+    while ((dir = readdir(dirp)) != 0)
+    {
+      // also skips partial downloads, which are hidden until complete
+      if (dir->d_name[0] != '.')
+      {
+        file_names.push_back(parentDir + "/" + dir->d_name);
+      }
+    }
+
+    closedir(dirp);
+  }
+
+  return file_names;
+}
+
+size_t
+SplitInto(const string& str, char delimiter, vector<string>& fields)
+{
+  // reuses the strings already in fields, so that splitting line after line
+  // into the same vector stops allocating once it has warmed up; fields
+  // beyond the returned count are stale and must be ignored
+  size_t num_fields = 0;
+  size_t pos_start = 0, pos_end;
+
+  while (true)
+  {
+    pos_end = str.find(delimiter, pos_start);
+
+    if (num_fields == fields.size())
+    {
+      fields.push_back(string());
+    }
+
+    size_t len = pos_end == string::npos ? string::npos : pos_end - pos_start;
+    fields[num_fields++].assign(str, pos_start, len);
+
+    if (pos_end == string::npos)
+    {
+      break;
+    }
+    pos_start = pos_end + 1;
+  }
+
+  return num_fields;
+}
+
+bool
+ParseCode(const string& str, long& code)
+{
+  // a field of nothing but digits, where stol would throw or stop early
+  if (str.empty() || str.size() > 18 ||
+      str.find_first_not_of("0123456789") != string::npos)
+  {
+    return false;
+  }
+  code = atol(str.c_str());
+  return true;
+}
+
+vector<string>
+Split(const string& str, const string& delimiter)
+{
+  size_t pos_start = 0, pos_end, delim_len = delimiter.length();
+
+  string token;
+  vector<string> res;
+
+  while ((pos_end = str.find(delimiter, pos_start)) != string::npos)
+  {
+    token = str.substr(pos_start, pos_end - pos_start);
+    pos_start = pos_end + delim_len;
+    res.push_back(token);
+  }
+
+  res.push_back(str.substr(pos_start));
+  return res;
+}
+
+stringstream
+ReadAllNavFiles(const vector<string>& fileNames, FileIo& io)
+{
+  cout << "Reading " << fileNames.size() << " NAV files" << endl;
+
+  vector<string> contents;
+  io.ReadFiles(fileNames, contents);
+
+  stringstream raw_mf_data;
+  for (size_t i = 0; i < contents.size(); ++i)
+  {
+    raw_mf_data << contents.at(i);
+  }
+
+  cout << "Read " << fileNames.size() << " NAV files" << endl;
+
+  return raw_mf_data;
+}
+
+class CodeIndex
+{
+public:
+  class Run
+  {
+  public:
+    long mCode;
+    uint64_t mOffset;
+    uint64_t mLength;
+    string mCategory;
+    string mAmc;
+  };
+
+public:
+  // Byte ranges of each scheme's consecutive records in a NAV file, along
+  // with the category and AMC section they appear in, so that the records of
+  // a range of codes can be read without the rest of the file. Saved next
+  // to the NAV file as a hidden .<name>.idx, which is rebuilt whenever the
+  // NAV file's size or modification time no longer match.
+  CodeIndex(const string& navFileName)
+    : mBuilt(false)
+  {
+    struct stat st;
+    if (stat(navFileName.c_str(), &st) != 0)
+    {
+      return;
+    }
+
+    ostringstream key;
+    key << "MFIDX01," << st.st_size << ","
+        << st.st_mtim.tv_sec << "." << st.st_mtim.tv_nsec;
+    mKey = key.str();
+
+    size_t slash = navFileName.rfind('/');
+    string index_file_name = navFileName.substr(0, slash + 1) + "." +
+                             navFileName.substr(slash + 1) + ".idx";
+
+    if (!Load(index_file_name, mKey))
+    {
+      Build(navFileName);
+      Save(index_file_name, mKey);
+      mBuilt = true;
+    }
+  }
+
+  const vector<Run>& Runs() const
+  {
+    return mRuns;
+  }
+
+  // identifies the indexed content of the NAV file, empty if it is missing
+  const string& Key() const
+  {
+    return mKey;
+  }
+
+  bool Built() const
+  {
+    return mBuilt;
+  }
+
+private:
+  bool Load(const string& indexFileName, const string& key)
+  {
+    ifstream in(indexFileName.c_str());
+    string line;
+    if (!getline(in, line) || line != key)
+    {
+      return false;
+    }
+
+    // code,offset,length,category,amc
+    vector<string> fields;
+    while (getline(in, line))
+    {
+      if (SplitInto(line, ',', fields) != 5)
+      {
+        mRuns.clear();
+        return false;
+      }
+      mRuns.push_back(Run{ stol(fields[0]), stoull(fields[1]),
+                           stoull(fields[2]), fields[3], fields[4] });
+    }
+    return true;
+  }
+
+  void Build(const string& navFileName)
+  {
+    // the sections are tracked the same way as by NavParser
+    ifstream in(navFileName.c_str(), ios::binary);
+    string line;
+    vector<string> fields;
+    string category;
+    string amc;
+    uint64_t offset = 0;
+    Run* run = nullptr;
+
+    while (getline(in, line))
+    {
+      const uint64_t line_offset = offset;
+      offset += line.size() + (in.eof() ? 0 : 1);
+
+      size_t num_fields = SplitInto(line, ';', fields);
+      if (num_fields == 6)
+      {
+        string& code = fields[0];
+        code.erase(0, code.find_first_not_of(" \t\r\n"));
+        code.erase(code.find_last_not_of(" \t\r\n") + 1);
+        if (code == "Scheme Code")
+        {
+          category.clear();
+          amc.clear();
+          run = nullptr;
+          continue;
+        }
+        if (code.empty() ||
+            code.find_first_not_of("0123456789") != string::npos)
+        {
+          continue;
+        }
+
+        long mf_code = stol(code);
+        if (run == nullptr || run->mCode != mf_code)
+        {
+          mRuns.push_back(Run{ mf_code, line_offset, 0, category, amc });
+          run = &mRuns.back();
+        }
+        run->mLength = offset - run->mOffset;
+      }
+      else if (num_fields == 1)
+      {
+        string& section = fields[0];
+        section.erase(0, section.find_first_not_of(" \t\r\n"));
+        section.erase(section.find_last_not_of(" \t\r\n") + 1);
+        section.erase(remove(section.begin(), section.end(), ','),
+                      section.end());
+
+        if (section.find("Schemes (") != string::npos)
+        {
+          category = section;
+          amc.clear();
+          run = nullptr;
+        }
+        else if (!section.empty())
+        {
+          amc = section;
+          run = nullptr;
+        }
+      }
+    }
+  }
+
+  void Save(const string& indexFileName, const string& key)
+  {
+    // shards building the same index concurrently each rename a complete
+    // file into place
+    string temp_file_name = indexFileName + "." + to_string(getpid());
+    ofstream out(temp_file_name.c_str());
+    out << key << "\n";
+    for (auto& run : mRuns)
+    {
+      out << run.mCode << "," << run.mOffset << "," << run.mLength << ","
+          << run.mCategory << "," << run.mAmc << "\n";
+    }
+    out.close();
+    rename(temp_file_name.c_str(), indexFileName.c_str());
+  }
+
+private:
+  string mKey;
+  vector<Run> mRuns;
+  bool mBuilt;
+};
+
+string
+ShardDirectory(const string& csvDir, unsigned shard, unsigned numShards)
+{
+  return csvDir + "/shards/" + to_string(shard) + "-of-" +
+         to_string(numShards);
+}
+
+bool
+ShardCodeRange(const vector<CodeIndex>& indexes,
+               unsigned shard,
+               unsigned numShards,
+               long& firstCode,
+               long& lastCode)
+{
+  // the codes of all files are split into numShards contiguous ranges with
+  // about the same number of bytes of records, a code belongs to the shard
+  // in which its records start; false if the shard has no codes
+  map<long, uint64_t> code_bytes;
+  uint64_t total_bytes = 0;
+  for (auto& index : indexes)
+  {
+    for (auto& run : index.Runs())
+    {
+      code_bytes[run.mCode] += run.mLength;
+      total_bytes += run.mLength;
+    }
+  }
+
+  firstCode = 0;
+  lastCode = -1;
+  if (total_bytes == 0)
+  {
+    return false;
+  }
+
+  uint64_t bytes = 0;
+  for (auto& codeKv : code_bytes)
+  {
+    if (bytes * numShards / total_bytes == shard)
+    {
+      if (lastCode < firstCode)
+      {
+        firstCode = codeKv.first;
+      }
+      lastCode = codeKv.first;
+    }
+    bytes += codeKv.second;
+  }
+
+  return lastCode >= firstCode;
+}
+
+string
+ShardManifest(const vector<string>& fileNames,
+              unsigned shard,
+              const Options& options)
+{
+  // What a shard's outputs were made from: its range of codes, the NAV
+  // files as indexed, and the options that shape the outputs. A shard
+  // writes it once all its outputs are complete, and a merge only takes
+  // shards whose manifest matches the one of the current NAV files.
+  const unsigned num_shards =
+    options.mNumShards > 0 ? options.mNumShards : options.mMergeShards;
+
+  vector<CodeIndex> indexes;
+  for (auto& file_name : fileNames)
+  {
+    indexes.push_back(CodeIndex(file_name));
+  }
+
+  long first_code;
+  long last_code;
+  ostringstream manifest;
+  manifest << "MFSHARD01," << shard << "," << num_shards << "\n";
+  if (ShardCodeRange(indexes, shard, num_shards, first_code, last_code))
+  {
+    manifest << "codes," << first_code << "," << last_code << "\n";
+  }
+  else
+  {
+    manifest << "codes\n";
+  }
+
+  manifest << "output," << options.mWriteCsvFiles << options.mWritePack
+           << options.mGzip << options.mBrotli << ","
+           << (options.mCategoryStats || options.mBacktest) << "\n";
+  if (options.mSipXirr)
+  {
+    manifest << "sip";
+    for (int months : options.mSipWindowMonths)
+    {
+      manifest << "," << months;
+    }
+    manifest << "\n";
+  }
+  if (options.mCorrEnabled)
+  {
+    manifest << "corr," << options.mCorrAllFunds << ","
+             << options.mCorrCategory << ","
+             << to_simple_string(options.mCorrFrom) << ","
+             << to_simple_string(options.mCorrTo);
+    for (long code : options.mCorrCodes)
+    {
+      manifest << "," << code;
+    }
+    manifest << "\n";
+  }
+
+  for (size_t f = 0; f < fileNames.size(); ++f)
+  {
+    manifest << "nav," << fileNames[f] << "," << indexes[f].Key() << "\n";
+  }
+
+  return manifest.str();
+}
+
+stringstream
+ReadShardNavFiles(const vector<string>& fileNames,
+                  unsigned shard, unsigned numShards)
+{
+  // only the records of this shard's range of codes are read, every run
+  // of records is preceded by its section lines, so that the result parses
+  // exactly like the full files
+  cout << "Reading shard " << shard << " of " << numShards
+       << " from " << fileNames.size() << " NAV files" << endl;
+
+  vector<CodeIndex> indexes;
+  int num_built = 0;
+  for (auto& file_name : fileNames)
+  {
+    indexes.push_back(CodeIndex(file_name));
+    num_built += indexes.back().Built();
+  }
+
+  long first_code;
+  long last_code;
+  stringstream raw_mf_data;
+  if (!ShardCodeRange(indexes, shard, numShards, first_code, last_code))
+  {
+    cout << "Read no MF codes for shard " << shard << endl;
+    return raw_mf_data;
+  }
+  const string header =
+    "Scheme Code;Scheme Name;Net Asset Value;Repurchase Price;Sale Price;Date\n";
+
+  uint64_t bytes_read = 0;
+  string buffer;
+  for (size_t f = 0; f < fileNames.size(); ++f)
+  {
+    vector<const CodeIndex::Run*> runs;
+    for (auto& run : indexes[f].Runs())
+    {
+      if (run.mCode >= first_code && run.mCode <= last_code)
+      {
+        runs.push_back(&run);
+      }
+    }
+    if (runs.empty())
+    {
+      continue;
+    }
+
+    int fd = open(fileNames[f].c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      cout << "Could not open " << fileNames[f] << ": " << strerror(errno)
+           << endl;
+      continue;
+    }
+
+    const string* category = nullptr;
+    const string* amc = nullptr;
+    for (size_t i = 0; i < runs.size(); )
+    {
+      // runs close to each other are read with a single call
+      const size_t MAX_GAP = 512;
+      size_t j = i + 1;
+      while (j < runs.size() &&
+             runs[j]->mOffset <=
+               runs[j - 1]->mOffset + runs[j - 1]->mLength + MAX_GAP)
+      {
+        ++j;
+      }
+
+      const uint64_t span_offset = runs[i]->mOffset;
+      const uint64_t span_length =
+        runs[j - 1]->mOffset + runs[j - 1]->mLength - span_offset;
+      buffer.resize(span_length);
+      ssize_t len = pread(fd, &buffer[0], span_length, span_offset);
+      if (len != static_cast<ssize_t>(span_length))
+      {
+        cout << "Could not read " << fileNames[f] << endl;
+        break;
+      }
+      bytes_read += len;
+
+      for (; i < j; ++i)
+      {
+        const CodeIndex::Run& run = *runs[i];
+        if (category == nullptr ||
+            *category != run.mCategory || *amc != run.mAmc)
+        {
+          raw_mf_data << header;
+          if (!run.mCategory.empty())
+          {
+            raw_mf_data << run.mCategory << "\n";
+          }
+          if (!run.mAmc.empty())
+          {
+            raw_mf_data << run.mAmc << "\n";
+          }
+          category = &run.mCategory;
+          amc = &run.mAmc;
+        }
+
+        raw_mf_data.write(buffer.data() + (run.mOffset - span_offset),
+                          run.mLength);
+        if (buffer[run.mOffset - span_offset + run.mLength - 1] != '\n')
+        {
+          raw_mf_data << "\n";
+        }
+      }
+    }
+
+    close(fd);
+  }
+
+  cout << "Read " << bytes_read << " bytes of MF Codes between "
+       << first_code << " and " << last_code << " for shard " << shard
+       << ", built " << num_built << " code indexes" << endl;
+
+  return raw_mf_data;
+}
+
+tuple<long, long>
+ReadMFCode(stringstream& rawMfData)
+{
+  cout << "Reading MF Data for minimum and maximum MF Code values" << endl;
+
+  set<long> mf_codes;
+  string line;
+  vector<string> fields;
+
+  rawMfData.clear();
+  rawMfData.seekg(0, rawMfData.beg);
+  while (getline(rawMfData, line))
+  {
+    if (line.size() > 0)
+    {
+      if (SplitInto(line, ';', fields) == 6 &&
+          !fields.at(0).empty() && // code
+          !fields.at(1).empty() && // name
+          !fields.at(2).empty() && // nav
+          !fields.at(5).empty())   // date
+      {
+        long code;
+
+        try
+        {
+          // silently fail
+          if (fields.at(0) == "Scheme Code")
+          {
+            continue;
+          }
+
+          // remove leading and trailing whitespaces
+          fields.at(0).erase(0, fields.at(0).find_first_not_of(" \t\r\n"));
+          fields.at(0).erase(fields.at(0).find_last_not_of(" \t\r\n") + 1);
+
+          if (fields.at(0).find_first_not_of("0123456789") !=
+              std::string::npos)
+          {
+            throw exception();
+          }
+
+          code = stol(fields.at(0));
+        }
+        catch (const exception& e)
+        {
+          cout << "Dropping: " << line << endl;
+          continue;
+        }
+
+        mf_codes.insert(code);
+      }
+    }
+  }
+
+  if (mf_codes.empty())
+  {
+    cout << "Read 0 mutual funds" << endl;
+    return make_tuple(0, -1);
+  }
+
+  long min_mf_code = *mf_codes.begin();
+  long max_mf_code = *mf_codes.rbegin();
+
+  cout << "Read " << mf_codes.size() << " mutual funds"
+       << " with minimum MF Code " << min_mf_code
+       << " and maximum MF Code " << max_mf_code
+       << endl;
+
+  return make_tuple(min_mf_code, max_mf_code);
+}
+
+class NavParser
+{
+public:
+  // Parses NAV report lines of the funds with codes in the given range into
+  // the arena. The report can be fed either line by line or as raw bytes in
+  // arbitrary chunks, as they arrive from a stream.
+  NavParser(long startingMfCode, long endingMfCode, Arena& arena)
+    : mStartingMfCode(startingMfCode),
+      mEndingMfCode(endingMfCode),
+      mArena(arena),
+      mNumNavs(0),
+      mpCategory(arena.Intern("")),
+      mpAmc(mpCategory)
+  {
+  }
+
+  NavParser(const NavParser&) = delete;
+  NavParser& operator=(const NavParser&) = delete;
+
+  void ParseBytes(const char* data, size_t size)
+  {
+    // only complete lines are parsed, the tail is kept for the next chunk
+    const char* end = data + size;
+    while (data < end)
+    {
+      const char* newline = static_cast<const char*>(
+          memchr(data, '\n', end - data));
+      if (newline == nullptr)
+      {
+        mPartialLine.append(data, end);
+        return;
+      }
+
+      if (mPartialLine.empty())
+      {
+        mLine.assign(data, newline);
+        ParseLine(mLine);
+      }
+      else
+      {
+        mPartialLine.append(data, newline);
+        ParseLine(mPartialLine);
+        mPartialLine.clear();
+      }
+      data = newline + 1;
+    }
+  }
+
+  void Finish()
+  {
+    if (!mPartialLine.empty())
+    {
+      ParseLine(mPartialLine);
+      mPartialLine.clear();
+    }
+  }
+
+  void ParseLine(const string& line)
+  {
+    if (line.empty())
+    {
+      return;
+    }
+
+    size_t num_fields = SplitInto(line, ';', mFields);
+    if (num_fields == 6 &&
+        !mFields.at(0).empty() && // code
+        !mFields.at(1).empty() && // name
+        !mFields.at(2).empty() && // nav
+        !mFields.at(5).empty())   // date
+    {
+      long code;
+      double nav_value;
+      boost::gregorian::date nav_date;
+
+      try
+      {
+        // silently fail, a new file starts
+        if (mFields.at(0) == "Scheme Code")
+        {
+          mpCategory = mArena.Intern("");
+          mpAmc = mpCategory;
+          return;
+        }
+
+        // silently fail
+        if (mFields.at(2) == "NA" ||
+            mFields.at(2) == "N.A." ||
+            mFields.at(2) == "N/A" ||
+            mFields.at(2) == "#N/A" ||
+            mFields.at(2) == "#DIV/0!" ||
+            mFields.at(2) == "B.C." ||
+            mFields.at(2) == "B. C." ||
+            mFields.at(2) == "-")
+        {
+          return;
+        }
+
+        // remove leading and trailing whitespaces
+        mFields.at(0).erase(0, mFields.at(0).find_first_not_of(" \t\r\n"));
+        mFields.at(0).erase(mFields.at(0).find_last_not_of(" \t\r\n") + 1);
+        mFields.at(1).erase(0, mFields.at(1).find_first_not_of(" \t\r\n"));
+        mFields.at(1).erase(mFields.at(1).find_last_not_of(" \t\r\n") + 1);
+        mFields.at(2).erase(0, mFields.at(2).find_first_not_of(" \t"));
+        mFields.at(2).erase(mFields.at(2).find_last_not_of(" \t") + 1);
+        mFields.at(5).erase(0, mFields.at(5).find_first_not_of(" \t\r\n"));
+        mFields.at(5).erase(mFields.at(5).find_last_not_of(" \t\r\n") + 1);
+
+        // remove " ' , \t \n from name
+        mFields.at(1).erase(remove(mFields.at(1).begin(),
+                                  mFields.at(1).end(),
+                                  '\"'),
+                           mFields.at(1).end());
+        mFields.at(1).erase(remove(mFields.at(1).begin(),
+                                  mFields.at(1).end(),
+                                  '\''),
+                           mFields.at(1).end());
+        mFields.at(1).erase(remove(mFields.at(1).begin(),
+                                  mFields.at(1).end(),
+                                  ','),
+                           mFields.at(1).end());
+        mFields.at(1).erase(remove(mFields.at(1).begin(),
+                                  mFields.at(1).end(),
+                                  '\t'),
+                           mFields.at(1).end());
+        mFields.at(1).erase(remove(mFields.at(1).begin(),
+                                  mFields.at(1).end(),
+                                  '\n'),
+                           mFields.at(1).end());
+
+        // remove comma from nav
+        mFields.at(2).erase(remove(mFields.at(2).begin(),
+                                  mFields.at(2).end(),
+                                  ','),
+                           mFields.at(2).end());
+
+        if (mFields.at(0).find_first_not_of("0123456789") !=
+            std::string::npos)
+        {
+          throw exception();
+        }
+
+        if (mFields.at(2).find_first_not_of("0123456789.") !=
+            std::string::npos)
+        {
+          throw exception();
+        }
+
+        code = stol(mFields.at(0));
+        nav_value = stod(mFields.at(2));
+
+        if (SplitInto(mFields.at(5), '-', mDates) != 3)
+        {
+          throw exception();
+        }
+
+        if (mDates.at(0).find_first_not_of("0123456789") !=
+            std::string::npos)
+        {
+          throw exception();
+        }
+
+        if (mDates.at(2).find_first_not_of("0123456789") !=
+            std::string::npos)
+        {
+          throw exception();
+        }
+
+        // yyyy, mmm, dd
+        nav_date = boost::gregorian::date(
+            stoi(mDates.at(2)),
+            boost::date_time::month_str_to_ushort<
+                boost::gregorian::greg_month>(mDates[1]),
+            stoi(mDates.at(0)));
+
+        // silently fail
+        if (nav_value == 0)
+        {
+          return;
+        }
+      }
+      catch (const exception& e)
+      {
+        //cout << "Dropping: " << line << endl;
+        return;
+      }
+
+      if (code < mStartingMfCode || code > mEndingMfCode)
+      {
+        return;
+      }
+
+      // the names are interned, so a name is only looked up when the fund
+      // is first seen or renamed and never copied per NAV line
+      const string& name = mFields.at(1);
+
+      auto it = mFunds.find(code);
+      if (it == mFunds.end())
+      {
+        it = mFunds.insert(
+            make_pair(code, MutualFund(code, name, mArena))).first;
+      }
+      else if (*it->second.mName != name)
+      {
+        it->second.mName = mArena.Intern(name);
+      }
+
+      it->second.mCategory = mpCategory;
+      it->second.mAmc = mpAmc;
+
+      it->second.mNavs.insert(make_pair(nav_date, nav_value));
+
+      mNumNavs++;
+    }
+    else if (num_fields == 1)
+    {
+      // section lines between the records, either a scheme category such
+      // as "Open Ended Schemes ( Income )" or the name of the AMC whose
+      // schemes follow
+      string& section = mFields.at(0);
+      section.erase(0, section.find_first_not_of(" \t\r\n"));
+      section.erase(section.find_last_not_of(" \t\r\n") + 1);
+      section.erase(remove(section.begin(), section.end(), ','),
+                    section.end());
+
+      if (section.find("Schemes (") != string::npos)
+      {
+        mpCategory = mArena.Intern(section);
+        mpAmc = mArena.Intern("");
+      }
+      else if (!section.empty())
+      {
+        mpAmc = mArena.Intern(section);
+      }
+    }
+  }
+
+  map<long, MutualFund>& Funds()
+  {
+    return mFunds;
+  }
+
+  int NumNavs() const
+  {
+    return mNumNavs;
+  }
+
+private:
+  long mStartingMfCode;
+  long mEndingMfCode;
+  Arena& mArena;
+  map<long, MutualFund> mFunds;
+  int mNumNavs;
+
+  // section of the report the following records belong to, interned
+  const string* mpCategory;
+  const string* mpAmc;
+
+  // reused between lines
+  string mLine;
+  string mPartialLine;
+  vector<string> mFields;
+  vector<string> mDates;
+};
+
+map<long, MutualFund>
+ReadMFData(stringstream& rawMfData,
+           long startingMfCode, long endingMfCode,
+           Arena& arena)
+{
+  cout << "Reading MF Data"
+       << " with MF Codes between " << startingMfCode
+       << " and " << endingMfCode << endl;
+
+  NavParser parser(startingMfCode, endingMfCode, arena);
+  string line;
+
+  rawMfData.clear();
+  rawMfData.seekg(0, rawMfData.beg);
+  while (getline(rawMfData, line))
+  {
+    parser.ParseLine(line);
+  }
+
+  cout << "Read " << parser.Funds().size() << " mutual funds and "
+       << parser.NumNavs() << " NAVs" << endl;
+
+  return move(parser.Funds());
+}
+
+class NavSource
+{
+public:
+  // One NAV report streamed into its own parser, read from a local file or
+  // stdin ("-"), or fetched over HTTP when mPath is set and then archived
+  // as mFileName.
+  string mFileName;
+  string mPath;
+};
+
+bool
+ParseHttpUrl(const string& url, string& host, string& port, string& path)
+{
+  // http://host[:port]/path?query, there is no TLS support
+  const string scheme = "http://";
+  if (url.compare(0, scheme.size(), scheme) != 0)
+  {
+    return false;
+  }
+
+  size_t slash = url.find('/', scheme.size());
+  string authority = url.substr(scheme.size(), slash - scheme.size());
+  path = slash == string::npos ? "/" : url.substr(slash);
+
+  size_t colon = authority.find(':');
+  host = authority.substr(0, colon);
+  port = colon == string::npos ? "80" : authority.substr(colon + 1);
+
+  return !host.empty() && !port.empty();
+}
+
+int
+ConnectTcp(const string& host, const string& port)
+{
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  addrinfo* addresses;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+  {
+    return -1;
+  }
+
+  int fd = -1;
+  for (addrinfo* p = addresses; p != nullptr; p = p->ai_next)
+  {
+    fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+    if (fd < 0)
+    {
+      continue;
+    }
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+    {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(addresses);
+
+  if (fd >= 0)
+  {
+    // a stalled server fails the month instead of hanging the run
+    timeval timeout = { 60, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
+  return fd;
+}
+
+bool
+StreamFd(int fd, NavParser& parser, size_t& numBytes, string& error)
+{
+  char buffer[64 * 1024];
+  ssize_t len;
+  while ((len = read(fd, buffer, sizeof(buffer))) != 0)
+  {
+    if (len < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      error = strerror(errno);
+      return false;
+    }
+
+    parser.ParseBytes(buffer, len);
+    numBytes += len;
+  }
+
+  parser.Finish();
+  return true;
+}
+
+bool
+StreamHttp(const string& host, const string& port, const string& path,
+           NavParser& parser, ostream& archive,
+           size_t& numBytes, string& error)
+{
+  int fd = ConnectTcp(host, port);
+  if (fd < 0)
+  {
+    error = "could not connect to " + host + ":" + port;
+    return false;
+  }
+
+  // HTTP/1.0 so that the body is never chunked and simply ends when the
+  // server closes the connection
+  string request = "GET " + path + " HTTP/1.0\r\n"
+                   "Host: " + host + "\r\n"
+                   "\r\n";
+  for (size_t sent = 0; sent < request.size(); )
+  {
+    ssize_t len = send(fd, request.data() + sent, request.size() - sent,
+                       MSG_NOSIGNAL);
+    if (len < 0 && errno != EINTR)
+    {
+      error = strerror(errno);
+      close(fd);
+      return false;
+    }
+    sent += max<ssize_t>(len, 0);
+  }
+
+  string header;
+  bool in_body = false;
+  long content_length = -1;
+  char buffer[64 * 1024];
+  ssize_t len;
+  while ((len = recv(fd, buffer, sizeof(buffer), 0)) != 0)
+  {
+    if (len < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      error = strerror(errno);
+      close(fd);
+      return false;
+    }
+
+    const char* body = buffer;
+    if (!in_body)
+    {
+      header.append(buffer, len);
+      size_t header_end = header.find("\r\n\r\n");
+      if (header_end == string::npos)
+      {
+        continue;
+      }
+
+      // "HTTP/1.1 200 OK"
+      vector<string> status;
+      SplitInto(header.substr(0, header.find("\r\n")), ' ', status);
+      if (status.size() < 2 || status.at(1) != "200")
+      {
+        error = "HTTP status " +
+                (status.size() < 2 ? string("missing") : status.at(1));
+        close(fd);
+        return false;
+      }
+
+      string lower_header = header.substr(0, header_end);
+      transform(lower_header.begin(), lower_header.end(),
+                lower_header.begin(), ::tolower);
+      size_t length_pos = lower_header.find("\r\ncontent-length:");
+      if (length_pos != string::npos)
+      {
+        content_length = atol(lower_header.c_str() + length_pos + 17);
+      }
+
+      // the rest of this read is already body
+      in_body = true;
+      size_t body_start = header_end + 4;
+      body = buffer + len - (header.size() - body_start);
+      len = header.size() - body_start;
+    }
+
+    parser.ParseBytes(body, len);
+    archive.write(body, len);
+    numBytes += len;
+  }
+
+  close(fd);
+  parser.Finish();
+
+  if (!in_body)
+  {
+    error = "incomplete response header";
+    return false;
+  }
+  if (content_length >= 0 && static_cast<long>(numBytes) != content_length)
+  {
+    error = "truncated body of " + to_string(numBytes) + " of " +
+            to_string(content_length) + " bytes";
+    return false;
+  }
+  return true;
+}
+
+vector<NavSource>
+GetNavSources(const Options& options, const string& navDir,
+              const string& path)
+{
+  vector<NavSource> sources;
+  if (options.mStreamSource == "-")
+  {
+    sources.push_back(NavSource{ "-", "" });
+    return sources;
+  }
+
+  // the months already archived are read from disk, as are any other NAV
+  // files, and only the missing months are fetched
+  set<string> file_names;
+  for (auto& file_name : GetNavFileNames(navDir))
+  {
+    file_names.insert(file_name);
+  }
+
+  boost::gregorian::date month(options.mStreamFrom.year(),
+                               options.mStreamFrom.month(), 1);
+  while (month <= options.mStreamTo)
+  {
+    boost::gregorian::date next_month =
+      month + boost::gregorian::months(1);
+    boost::gregorian::date month_end =
+      next_month - boost::gregorian::days(1);
+
+    ostringstream file_name;
+    file_name << navDir << "/Nav-" << month.year() << "-"
+              << setw(2) << setfill('0') << month.month().as_number()
+              << ".txt";
+
+    if (file_names.find(file_name.str()) == file_names.end())
+    {
+      // frmdt=01-Jan-2008&todt=31-Jan-2008
+      ostringstream query;
+      query << "frmdt=01-" << month.month().as_short_string()
+            << "-" << month.year()
+            << "&todt=" << month_end.day() << "-"
+            << month_end.month().as_short_string() << "-" << month_end.year();
+      sources.push_back(NavSource{ file_name.str(), path + query.str() });
+    }
+    else
+    {
+      sources.push_back(NavSource{ file_name.str(), "" });
+      file_names.erase(file_name.str());
+    }
+
+    month = next_month;
+  }
+
+  for (auto& file_name : file_names)
+  {
+    sources.push_back(NavSource{ file_name, "" });
+  }
+
+  // later reports take precedence for scheme names, as in file order
+  sort(sources.begin(), sources.end(),
+       [](const NavSource& a, const NavSource& b)
+       {
+         return a.mFileName < b.mFileName;
+       });
+  return sources;
+}
+
+map<long, MutualFund>
+StreamNavReports(const Options& options, const string& navDir, Arena& arena)
+{
+  string host;
+  string port;
+  string path;
+  if (options.mStreamSource != "-" &&
+      !ParseHttpUrl(options.mStreamSource, host, port, path))
+  {
+    throw runtime_error("Not an http:// URL: " + options.mStreamSource);
+  }
+
+  mkdir(navDir.c_str(), 0755);
+  vector<NavSource> sources = GetNavSources(options, navDir, path);
+
+  cout << "Streaming " << sources.size() << " NAV reports" << endl;
+
+  // every report has its own parser, so that the reports are parsed as
+  // their bytes arrive without any locking, and are merged in order after
+  vector<unique_ptr<Arena>> arenas;
+  vector<unique_ptr<NavParser>> parsers;
+  for (size_t i = 0; i < sources.size(); ++i)
+  {
+    arenas.emplace_back(new Arena());
+    parsers.emplace_back(
+        new NavParser(0, numeric_limits<long>::max(), *arenas.back()));
+  }
+
+  atomic<size_t> next_source(0);
+  mutex print_mutex;
+  size_t num_failed = 0;
+  auto worker = [&]()
+  {
+    size_t i;
+    while ((i = next_source++) < sources.size())
+    {
+      const NavSource& source = sources[i];
+      size_t num_bytes = 0;
+      string error;
+      bool ok;
+
+      if (!source.mPath.empty())
+      {
+        // the raw report is archived next to the other NAV files, under a
+        // hidden name until it is complete
+        size_t slash = source.mFileName.rfind('/');
+        string part_file = source.mFileName.substr(0, slash + 1) + "." +
+                           source.mFileName.substr(slash + 1) + ".part";
+        ofstream archive(part_file.c_str(), ios::binary);
+        ok = StreamHttp(host, port, source.mPath, *parsers[i], archive,
+                        num_bytes, error);
+        archive.close();
+        if (ok && archive.good())
+        {
+          rename(part_file.c_str(), source.mFileName.c_str());
+        }
+        else
+        {
+          unlink(part_file.c_str());
+        }
+      }
+      else
+      {
+        int fd = source.mFileName == "-" ?
+                 STDIN_FILENO :
+                 open(source.mFileName.c_str(), O_RDONLY | O_CLOEXEC);
+        ok = fd >= 0 && StreamFd(fd, *parsers[i], num_bytes, error);
+        if (fd < 0)
+        {
+          error = strerror(errno);
+        }
+        else if (fd != STDIN_FILENO)
+        {
+          close(fd);
+        }
+      }
+
+      lock_guard<mutex> lock(print_mutex);
+      if (ok)
+      {
+        cout << (source.mPath.empty() ? "Read " : "Fetched ")
+             << source.mFileName << " (" << num_bytes << " bytes)" << endl;
+      }
+      else
+      {
+        cout << "Could not " << (source.mPath.empty() ? "read " : "fetch ")
+             << source.mFileName << ": " << error << endl;
+        ++num_failed;
+      }
+    }
+  };
+
+  vector<thread> workers;
+  unsigned num_workers = min<size_t>(options.mStreamJobs, sources.size());
+  for (unsigned i = 0; i < num_workers; ++i)
+  {
+    workers.emplace_back(worker);
+  }
+  for (auto& t : workers)
+  {
+    t.join();
+  }
+
+  // a partly parsed report would leave a month silently incomplete, the
+  // reports fetched in full are archived and not fetched again
+  if (num_failed > 0)
+  {
+    throw runtime_error("Could not stream " + to_string(num_failed) + " of " +
+                        to_string(sources.size()) + " NAV reports");
+  }
+
+  // the first NAV of a date is kept and the latest report names the fund,
+  // the same as when the reports are read one after another; each report
+  // is released once merged
+  map<long, MutualFund> mutual_funds;
+  int num_nav = 0;
+  for (size_t i = 0; i < parsers.size(); ++i)
+  {
+    const unique_ptr<NavParser>& parser = parsers[i];
+    num_nav += parser->NumNavs();
+    for (auto& mfKv : parser->Funds())
+    {
+      const MutualFund& mf = mfKv.second;
+      auto it = mutual_funds.find(mf.mCode);
+      if (it == mutual_funds.end())
+      {
+        it = mutual_funds.insert(
+            make_pair(mf.mCode, MutualFund(mf.mCode, *mf.mName, arena))).first;
+      }
+      else
+      {
+        it->second.mName = arena.Intern(*mf.mName);
+      }
+      // the parser's arena is released after the merge
+      it->second.mCategory = arena.Intern(*mf.mCategory);
+      it->second.mAmc = arena.Intern(*mf.mAmc);
+      it->second.mNavs.insert(mf.mNavs.begin(), mf.mNavs.end());
+    }
+
+    parsers[i].reset();
+    arenas[i].reset();
+  }
+
+  cout << "Read " << mutual_funds.size() << " mutual funds and "
+       << num_nav << " NAVs" << endl;
+
+  return mutual_funds;
+}
+
+void
+AddMissingDates(map<long, MutualFund>& mutualFunds, bool compact)
+{
+  cout << "Cleaning " << mutualFunds.size() << " mutual funds" << endl;
+
+  int added_navs = 0;
+  int i = 0;
+
+  vector<double> navs;
+  for (auto& mfKv : mutualFunds)
+  {
+    ++i;
+    if (i % 1000 == 0)
+    {
+      cout << "[" << (i + 1) << "/" << mutualFunds.size() << "]"
+           << " Cleaning..." << endl;
+    }
+
+    MutualFund& mf = mfKv.second;
+    MutualFundData& data = mf.mData;
+    data.mFirstDate = mf.mNavs.begin()->first;
+    data.mNumDays = (mf.mNavs.rbegin()->first - data.mFirstDate).days() + 1;
+
+    navs.clear();
+    for (auto& navKv : mf.mNavs)
+    {
+      const size_t day = (navKv.first - data.mFirstDate).days();
+      if (day > navs.size())
+      {
+        // for missing dates, use the last read nav
+        added_navs += day - navs.size();
+        navs.resize(day, navs.back());
+      }
+      navs.push_back(navKv.second);
+    }
+
+    data.Get(MutualFundData::TYPE::NAV).Assign(0, navs);
+    if (compact)
+    {
+      data.Compact(MutualFundData::TYPE::NAV);
+    }
+  }
+
+  cout << "Cleaned " << mutualFunds.size() << " mutual funds"
+       << " and added " << added_navs << " NAVs" << endl;
+}
+
+tuple<bool, double>
+CalculateCagr(const vector<double>& navs,
+              size_t presentDay,
+              int daysAgo)
+{
+  if (presentDay >= static_cast<size_t>(daysAgo))
+  {
+    const double old_val = navs[presentDay - daysAgo];
+    const double present_val = navs[presentDay];
+
+    double cagr = (pow((present_val / old_val), 365.0f/daysAgo) - 1) * 100.0f;
+    return make_tuple(true, cagr);
+  }
+
+  return make_tuple(false, 0);
+}
+
+tuple<bool, double>
+CalculateAverage(
+    const vector<double>& values,
+    size_t presentDay,
+    double& rollingTotal,
+    int windowDays)
+{
+  const double current_value = values[presentDay];
+
+  rollingTotal += current_value;
+
+  if (presentDay >= static_cast<size_t>(windowDays - 1))
+  {
+    const size_t first_day = presentDay - (windowDays - 1);
+
+    double current_average = rollingTotal / windowDays;
+
+    rollingTotal -= values[first_day];
+
+    return make_tuple(true, current_average);
+  }
+
+  return make_tuple(false, 0);
+}
+
+// values[i] is the value of day firstDay + i, the days before it have none
+tuple<bool, double, double>
+CalculateAverageAndVarianceSum(
+    const vector<double>& values,
+    size_t firstDay,
+    size_t presentDay,
+    double& rollingTotal,
+    double& prevVarSum,
+    double& prevAverage,
+    int windowDays)
+{
+  if (presentDay >= firstDay)
+  {
+    const double current_value = values[presentDay - firstDay];
+
+    rollingTotal += current_value;
+
+    if (presentDay >= static_cast<size_t>(windowDays - 1))
+    {
+      const size_t first_day = presentDay - (windowDays - 1);
+      if (first_day < firstDay)
+      {
+        return make_tuple(false, 0, 0);
+      }
+
+      double current_average = rollingTotal / windowDays;
+
+      rollingTotal -= values[first_day - firstDay];
+
+      // first run
+      double var_sum;
+      if (prevVarSum == 0)
+      {
+        double squared_diff_total = 0;
+        for (size_t day = first_day; day <= presentDay; ++day)
+        {
+          const double value = values[day - firstDay];
+          squared_diff_total += pow(value - current_average, 2);
+        }
+        var_sum = squared_diff_total;
+      }
+      else
+      {
+        const double out_of_window_value = values[first_day - 1 - firstDay];
+
+        var_sum = prevVarSum +
+          ((current_value - out_of_window_value) *
+          (current_value - current_average + out_of_window_value - prevAverage));
+      }
+
+      prevAverage = current_average;
+      prevVarSum = var_sum;
+
+      return make_tuple(true, var_sum, current_average);
+    }
+  }
+
+  return make_tuple(false, 0, 0);
+}
+
+void
+CalculateStatistics(map<long, MutualFund>& mutualFunds, bool compact)
+{
+  // cagr = ((final_value / initial_value)^(1 / number of periods) - 1) x 100
+  // std_dev = ((sum of [(actual - mean)^2]) / N)^(1/2)
+  // std_dev = sqrt(var_sum/size)
+  // http://jonisalonen.com/2014/efficient-and-accurate-rolling-standard-deviation/
+  // variance_sum = prev_variance_sum +
+  //   (newest_val - oldest_val_just_outside_window) *
+  //   (newest_val - new_avg + oldest_val_just_outside_window - prev_avg)
+  //
+  // Every statistic is calculated in double from the NAVs as doubles and
+  // only then stored, see MutualFundData::Compact for the compact storage.
+
+  cout << "Calculating statistics for " << mutualFunds.size()
+       << " mutual funds" << endl;
+
+  // the days from which each statistic is available
+  const size_t ONE_MNTH_AVG_FIRST_DAY = 14;
+  const size_t TWO_YR_STD_DEV_FIRST_DAY = 365 + 730 - 1;
+  const size_t FOUR_YR_STD_DEV_FIRST_DAY = 365 + 1460 - 1;
+
+  // reused for every fund
+  vector<double> navs;
+  vector<double> one_mnth_nav_avgs;
+  vector<double> one_yr_nav_cagrs;
+  vector<double> three_yr_nav_cagrs;
+  vector<double> five_yr_nav_cagrs;
+  vector<double> two_yr_std_devs;
+  vector<double> four_yr_std_devs;
+
+  int i = 0;
+  for (auto& mfKv : mutualFunds)
+  {
+    ++i;
+    if (i % 1000 == 0)
+    {
+      cout << "[" << (i + 1) << "/" << mutualFunds.size() << "]"
+           << " Calculating..." << endl;
+    }
+
+    MutualFundData& data = mfKv.second.mData;
+    const DailyColumn& nav_column = data.Get(MutualFundData::TYPE::NAV);
+    navs.resize(data.mNumDays);
+    for (size_t day = 0; day < data.mNumDays; ++day)
+    {
+      navs[day] = nav_column[day];
+    }
+
+    one_mnth_nav_avgs.clear();
+    one_yr_nav_cagrs.clear();
+    three_yr_nav_cagrs.clear();
+    five_yr_nav_cagrs.clear();
+    two_yr_std_devs.clear();
+    four_yr_std_devs.clear();
+
+    double one_yr_nav_rolling_total = 0;
+
+    double two_yr_rolling_total_for_one_yr_nav_cagr = 0;
+    double prev_two_yr_var_sum_for_one_yr_nav_cagr = 0;
+    double prev_two_yr_avg_for_one_yr_nav_cagr = 0;
+
+    double four_yr_rolling_total_for_one_yr_nav_cagr = 0;
+    double prev_four_yr_var_sum_for_one_yr_nav_cagr = 0;
+    double prev_four_yr_avg_for_one_yr_nav_cagr = 0;
+
+    for (size_t day = 0; day < data.mNumDays; ++day)
+    {
+      // NAV AVG ----------------------------------------------------
+      {
+        // the average of the 30 days to this one, for the day 15 before
+        auto res = CalculateAverage(navs, day, one_yr_nav_rolling_total, 30);
+        if (get<0>(res))
+        {
+          one_mnth_nav_avgs.push_back(get<1>(res));
+        }
+      }
+
+      // NAV CAGR ---------------------------------------------------
+      {
+        auto res = CalculateCagr(navs, day, 365);
+        if (get<0>(res))
+        {
+          one_yr_nav_cagrs.push_back(get<1>(res));
+        }
+      }
+      {
+        auto res = CalculateCagr(navs, day, 1095);
+        if (get<0>(res))
+        {
+          three_yr_nav_cagrs.push_back(get<1>(res));
+        }
+      }
+      {
+        auto res = CalculateCagr(navs, day, 1825);
+        if (get<0>(res))
+        {
+          five_yr_nav_cagrs.push_back(get<1>(res));
+        }
+      }
+
+      // DEVIATION OF 1 YR CAGR -------------------------------------
+      {
+        auto res = CalculateAverageAndVarianceSum(
+            one_yr_nav_cagrs, 365, day,
+            two_yr_rolling_total_for_one_yr_nav_cagr,
+            prev_two_yr_var_sum_for_one_yr_nav_cagr,
+            prev_two_yr_avg_for_one_yr_nav_cagr,
+            730);
+
+        if (get<0>(res))
+        {
+          two_yr_std_devs.push_back(pow(get<1>(res) / 730.0f, 0.5f));
+        }
+      }
+      {
+        auto res = CalculateAverageAndVarianceSum(
+            one_yr_nav_cagrs, 365, day,
+            four_yr_rolling_total_for_one_yr_nav_cagr,
+            prev_four_yr_var_sum_for_one_yr_nav_cagr,
+            prev_four_yr_avg_for_one_yr_nav_cagr,
+            1460);
+
+        if (get<0>(res))
+        {
+          four_yr_std_devs.push_back(pow(get<1>(res) / 1460.0f, 0.5f));
+        }
+      }
+    }
+
+    auto store = [&](MutualFundData::TYPE type,
+                     size_t firstDay,
+                     const vector<double>& values)
+    {
+      data.Get(type).Assign(firstDay, values);
+      if (compact)
+      {
+        data.Compact(type);
+      }
+    };
+
+    store(MutualFundData::TYPE::ONE_MNTH_NAV_AVG, ONE_MNTH_AVG_FIRST_DAY,
+          one_mnth_nav_avgs);
+    store(MutualFundData::TYPE::ONE_YR_NAV_CAGR, 365, one_yr_nav_cagrs);
+    store(MutualFundData::TYPE::THREE_YR_NAV_CAGR, 1095, three_yr_nav_cagrs);
+    store(MutualFundData::TYPE::FIVE_YR_NAV_CAGR, 1825, five_yr_nav_cagrs);
+    store(MutualFundData::TYPE::TWO_YR_STD_DEV_OF_ONE_YR_NAV_CAGR,
+          TWO_YR_STD_DEV_FIRST_DAY, two_yr_std_devs);
+    store(MutualFundData::TYPE::FOUR_YR_STD_DEV_OF_ONE_YR_NAV_CAGR,
+          FOUR_YR_STD_DEV_FIRST_DAY, four_yr_std_devs);
+  }
+
+  cout << "Calculated statistics for " << mutualFunds.size()
+       << " mutual funds" << endl;
+}
+
+class PackWriter
+{
+public:
+  // All fund CSVs concatenated into one file, followed by an index of
+  // "code,offset,length" lines and a fixed width trailer
+  // "MFPACK01,<20 digit index offset>\n" so that readers can locate the
+  // index from the end of the file. The pack is written to a temporary file
+  // and renamed when complete, so readers never see a partial pack.
+  PackWriter(const string& fileName)
+    : mFileName(fileName),
+      mTempFileName(fileName + ".tmp"),
+      mOffset(0)
+  {
+    mOut.rdbuf()->pubsetbuf(mBuffer, sizeof(mBuffer));
+    mOut.open(mTempFileName.c_str(), ios::binary | ios::trunc);
+  }
+
+  PackWriter(const PackWriter&) = delete;
+  PackWriter& operator=(const PackWriter&) = delete;
+
+  void Add(long code, const string& csvData)
+  {
+    mOut.write(csvData.data(), csvData.size());
+    mIndex.push_back(make_tuple(code, mOffset, csvData.size()));
+    mOffset += csvData.size();
+  }
+
+  bool Close()
+  {
+    stringstream index;
+    for (auto& entry : mIndex)
+    {
+      index << get<0>(entry) << ","
+            << get<1>(entry) << ","
+            << get<2>(entry) << "\n";
+    }
+    mOut << index.rdbuf();
+
+    mOut << "MFPACK01," << setw(20) << setfill('0') << mOffset << "\n";
+    mOut.close();
+
+    if (!mOut || rename(mTempFileName.c_str(), mFileName.c_str()) != 0)
+    {
+      cout << "Could not write " << mFileName << ": " << strerror(errno)
+           << endl;
+      unlink(mTempFileName.c_str());
+      return false;
+    }
+
+    cout << "Wrote " << mFileName << " with " << mIndex.size()
+         << " mutual funds" << endl;
+    return true;
+  }
+
+private:
+  string mFileName;
+  string mTempFileName;
+  ofstream mOut;
+  char mBuffer[1 << 20];
+  uint64_t mOffset;
+  vector<tuple<long, uint64_t, uint64_t>> mIndex;
+};
+
+void
+RemovePacks(const string& directory)
+{
+  // the web app prefers a pack over the csv files, so a csv only run must
+  // not leave an earlier run's packs to be served instead of its output
+  for (const char* extension : { "", ".gz", ".br" })
+  {
+    unlink((directory + "/navs.pack" + extension).c_str());
+  }
+}
+
+string
+GzipCompress(const string& data)
+{
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+
+  // 15 window bits + 16 for a gzip header instead of a zlib one
+  if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    throw runtime_error("deflateInit2 failed");
+  }
+
+  string compressed(deflateBound(&zs, data.size()), '\0');
+
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  zs.avail_in = data.size();
+  zs.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+  zs.avail_out = compressed.size();
+
+  int ret = deflate(&zs, Z_FINISH);
+  deflateEnd(&zs);
+
+  if (ret != Z_STREAM_END)
+  {
+    throw runtime_error("deflate failed");
+  }
+
+  compressed.resize(zs.total_out);
+  return compressed;
+}
+
+string
+BrotliCompress(const string& data)
+{
+  size_t size = BrotliEncoderMaxCompressedSize(data.size());
+  string compressed(max<size_t>(size, 64), '\0');
+  size = compressed.size();
+
+  // brotli ships a static dictionary trained on web content, which is what
+  // makes it pay off on short csv files; quality 11 is too slow for nightly
+  if (!BrotliEncoderCompress(9, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                             data.size(),
+                             reinterpret_cast<const uint8_t*>(data.data()),
+                             &size,
+                             reinterpret_cast<uint8_t*>(&compressed[0])))
+  {
+    throw runtime_error("BrotliEncoderCompress failed");
+  }
+
+  compressed.resize(size);
+  return compressed;
+}
+
+class Compressor
+{
+public:
+  // Compresses fund CSVs on a pool of worker threads while the main thread
+  // keeps reading and calculating the next batch. Writes <code>.csv.gz /
+  // <code>.csv.br next to the csv files and/or navs.pack.gz / navs.pack.br
+  // in packDirectory whose entries are each a complete compressed stream.
+  Compressor(const Options& options,
+             const string& directory,
+             const string& packDirectory,
+             unsigned numThreads)
+    : mOptions(options),
+      mDirectory(directory),
+      mMaxQueued(4 * numThreads),
+      mDone(false),
+      mNumCompressed(0)
+  {
+    if (mOptions.mWritePack && mOptions.mGzip)
+    {
+      mpGzipPack.reset(new PackWriter(packDirectory + "/navs.pack.gz"));
+    }
+    if (mOptions.mWritePack && mOptions.mBrotli)
+    {
+      mpBrotliPack.reset(new PackWriter(packDirectory + "/navs.pack.br"));
+    }
+
+    for (unsigned i = 0; i < numThreads; ++i)
+    {
+      mThreads.push_back(thread(&Compressor::Run, this));
+    }
+  }
+
+  Compressor(const Compressor&) = delete;
+  Compressor& operator=(const Compressor&) = delete;
+
+  void Add(long code, string csvData)
+  {
+    unique_lock<mutex> lock(mMutex);
+    mNotFull.wait(lock, [this]() { return mQueue.size() < mMaxQueued; });
+    mQueue.push_back(make_pair(code, move(csvData)));
+    mNotEmpty.notify_one();
+  }
+
+  bool Finish()
+  {
+    {
+      lock_guard<mutex> lock(mMutex);
+      mDone = true;
+    }
+    mNotEmpty.notify_all();
+
+    for (auto& t : mThreads)
+    {
+      t.join();
+    }
+
+    bool closed = true;
+    if (mpGzipPack)
+    {
+      closed = mpGzipPack->Close() && closed;
+    }
+    if (mpBrotliPack)
+    {
+      closed = mpBrotliPack->Close() && closed;
+    }
+
+    cout << "Compressed " << mNumCompressed << " mutual funds" << endl;
+    return closed;
+  }
+
+private:
+  void Run()
+  {
+    while (true)
+    {
+      pair<long, string> job;
+      {
+        unique_lock<mutex> lock(mMutex);
+        mNotEmpty.wait(lock, [this]() { return mDone || !mQueue.empty(); });
+        if (mQueue.empty())
+        {
+          return;
+        }
+        job = move(mQueue.front());
+        mQueue.pop_front();
+        mNotFull.notify_one();
+      }
+
+      if (mOptions.mGzip)
+      {
+        Write(job.first, ".csv.gz", GzipCompress(job.second),
+              mpGzipPack.get());
+      }
+      if (mOptions.mBrotli)
+      {
+        Write(job.first, ".csv.br", BrotliCompress(job.second),
+              mpBrotliPack.get());
+      }
+
+      ++mNumCompressed;
+    }
+  }
+
+  void Write(long code,
+             const string& extension,
+             const string& compressed,
+             PackWriter* pPackWriter)
+  {
+    if (mOptions.mWriteCsvFiles)
+    {
+      string file_name = mDirectory + "/" + to_string(code) + extension;
+      ofstream out(file_name.c_str(), ios::binary);
+      out.write(compressed.data(), compressed.size());
+      out.close();
+    }
+
+    if (pPackWriter)
+    {
+      lock_guard<mutex> lock(mPackMutex);
+      pPackWriter->Add(code, compressed);
+    }
+  }
+
+private:
+  const Options& mOptions;
+  string mDirectory;
+  size_t mMaxQueued;
+
+  mutex mMutex;
+  condition_variable mNotEmpty;
+  condition_variable mNotFull;
+  deque<pair<long, string>> mQueue;
+  bool mDone;
+
+  mutex mPackMutex;
+  unique_ptr<PackWriter> mpGzipPack;
+  unique_ptr<PackWriter> mpBrotliPack;
+
+  vector<thread> mThreads;
+  atomic<long> mNumCompressed;
+};
+
+void
+FormatMfData(const MutualFund& mf, ostream& out)
+{
+  out << fixed << setprecision(4);
+  for (size_t day = 0; day < mf.mData.mNumDays; ++day)
+  {
+    mf.mData.FormatRow(out, day);
+    out << "\n";
+  }
+}
+
+void
+WriteToCsv(map<long, MutualFund>& mutualFunds,
+           const string& directory,
+           const Options& options,
+           FileIo& io,
+           PackWriter* pPackWriter,
+           Compressor* pCompressor,
+           stringstream& mfCodeLookup,
+           stringstream& mfCategoryLookup)
+{
+  cout << "Writing CSVs for " << mutualFunds.size()
+       << " mutual funds" << endl;
+
+  // A compressed variant must not be older than its csv file, or it is
+  // not served, so the csv files the backend still has queued are only
+  // compressed once they are written
+  deque<pair<long, string>> uncompressed;
+  auto compress_written = [&]()
+  {
+    const size_t num_queued = options.mWriteCsvFiles ?
+      io.NumQueuedWrites() : 0;
+    while (uncompressed.size() > num_queued)
+    {
+      pCompressor->Add(uncompressed.front().first,
+                       move(uncompressed.front().second));
+      uncompressed.pop_front();
+    }
+  };
+
+  int i = 0;
+  ostringstream csv_data;
+  for (auto& mfKv : mutualFunds)
+  {
+    ++i;
+    if (i % 1000 == 0)
+    {
+      cout << "[" << (i + 1) << "/" << mutualFunds.size() << "]"
+           << " Writing..." << endl;
+    }
+
+    csv_data.str("");
+    FormatMfData(mfKv.second, csv_data);
+    string csv = csv_data.str();
+
+    if (options.mWriteCsvFiles)
+    {
+      io.WriteFile(directory + "/" + to_string(mfKv.second.mCode) + ".csv",
+                   csv);
+    }
+
+    if (pPackWriter)
+    {
+      pPackWriter->Add(mfKv.second.mCode, csv);
+    }
+
+    if (pCompressor)
+    {
+      uncompressed.push_back(make_pair(mfKv.second.mCode, move(csv)));
+      compress_written();
+    }
+  }
+
+  io.Flush();
+  if (pCompressor)
+  {
+    compress_written();
+  }
+
+  for (auto& mfKv : mutualFunds)
+  {
+    mfCodeLookup << to_string(mfKv.first) << ","
+                 << *mfKv.second.mName
+                 << endl;
+    mfCategoryLookup << to_string(mfKv.first) << ","
+                     << *mfKv.second.mCategory << ","
+                     << *mfKv.second.mAmc
+                     << endl;
+  }
+
+  cout << "Wrote CSVs for " << mutualFunds.size()
+       << " mutual funds" << endl;
+}
+
+void
+WriteMfNameIndex(const string& directory, const string& mfCodeLookup)
+{
+  // typeahead index, one line per lowercase word of a scheme name followed
+  // by the codes of all schemes containing it:
+  //   growth,100029 100034 ...
+  // lines are sorted by word so that all words starting with a prefix form
+  // one contiguous run which the web server finds with a binary search
+  map<string, set<long>> word_codes;
+
+  istringstream in(mfCodeLookup);
+  string line;
+  while (getline(in, line))
+  {
+    size_t comma = line.find(',');
+    if (comma == string::npos)
+    {
+      continue;
+    }
+
+    long code = atol(line.substr(0, comma).c_str());
+    string word;
+    for (size_t i = comma + 1; i <= line.size(); ++i)
+    {
+      unsigned char c = i < line.size() ? line[i] : ' ';
+      if (isalnum(c))
+      {
+        word += tolower(c);
+      }
+      else if (!word.empty())
+      {
+        word_codes[word].insert(code);
+        word.clear();
+      }
+    }
+  }
+
+  string file_name = directory + "/mf_name_index.csv";
+  ofstream out(file_name.c_str());
+  for (auto& wordKv : word_codes)
+  {
+    out << wordKv.first << ",";
+    const char* sep = "";
+    for (long code : wordKv.second)
+    {
+      out << sep << code;
+      sep = " ";
+    }
+    out << "\n";
+  }
+  out.close();
+
+  cout << "Wrote name index of " << word_codes.size() << " words" << endl;
+}
+
+void
+WriteMfCodeLookupToCsv(const string& directory,
+                       const stringstream& mfCodeLookup,
+                       const stringstream& mfCategoryLookup)
+{
+  cout << "Writing CSV for MF Code lookup" << endl;
+
+  string file_name = directory + "/mf_code_names.csv";
+  ofstream out(file_name.c_str());
+  out << mfCodeLookup.rdbuf();
+  out.close();
+
+  // code,category,amc
+  string file_name2 = directory + "/mf_code_categories.csv";
+  ofstream out2(file_name2.c_str());
+  out2 << mfCategoryLookup.rdbuf();
+  out2.close();
+
+  string file_name1 = directory + "/format.csv";
+  ofstream out1(file_name1.c_str());
+
+  out1 << "Date,"
+       << "NAV,"                          // 0
+       << "1 Mnth Avg,"                   // 1
+       << "1 Yr Cagr,"                    // 2
+       << "3 Yr Cagr,"                    // 3
+       << "5 Yr Cagr,"                    // 4
+       << "2 Yr Std Dev of 1 Yr Cagr,"    // 5
+       << "4 Yr Std Dev of 1 Yr Cagr,"    // 6
+       << endl;
+
+  out1.close();
+
+  WriteMfNameIndex(directory, mfCodeLookup.str());
+
+  cout << "Wrote CSV for MF Code lookup" << endl;
+}
+
+void
+CollectDailyReturns(
+    const map<long, MutualFund>& mutualFunds,
+    const Options& options,
+    map<long, vector<pair<boost::gregorian::date, double>>>& dailyReturns)
+{
+  // must run before AddMissingDates so that only days with a reported NAV
+  // contribute a return, otherwise holidays add spurious zero returns
+  for (auto& mfKv : mutualFunds)
+  {
+    if (!options.IsCorrFund(mfKv.second))
+    {
+      continue;
+    }
+
+    vector<pair<boost::gregorian::date, double>>& returns =
+      dailyReturns[mfKv.first];
+
+    const double* prev_nav = nullptr;
+    for (auto& navKv : mfKv.second.mNavs)
+    {
+      const double* nav = &navKv.second;
+      if (prev_nav != nullptr &&
+          navKv.first >= options.mCorrFrom &&
+          navKv.first <= options.mCorrTo)
+      {
+        returns.push_back(make_pair(navKv.first, log(*nav / *prev_nav)));
+      }
+      prev_nav = nav;
+    }
+  }
+}
+
+ReturnMatrix
+BuildReturnMatrix(
+    const map<long, vector<pair<boost::gregorian::date, double>>>& dailyReturns)
+{
+  cout << "Building return matrix for " << dailyReturns.size()
+       << " mutual funds" << endl;
+
+  ReturnMatrix matrix;
+
+  boost::gregorian::date last_date(boost::gregorian::not_a_date_time);
+  for (auto& retKv : dailyReturns)
+  {
+    if (retKv.second.empty())
+    {
+      continue;
+    }
+
+    if (matrix.mFirstDate.is_not_a_date() ||
+        retKv.second.front().first < matrix.mFirstDate)
+    {
+      matrix.mFirstDate = retKv.second.front().first;
+    }
+    if (last_date.is_not_a_date() || retKv.second.back().first > last_date)
+    {
+      last_date = retKv.second.back().first;
+    }
+  }
+
+  if (!matrix.mFirstDate.is_not_a_date())
+  {
+    matrix.mNumDays = (last_date - matrix.mFirstDate).days() + 1;
+  }
+
+  matrix.mReturns.assign(dailyReturns.size() * matrix.mNumDays,
+                         numeric_limits<double>::quiet_NaN());
+
+  size_t fund = 0;
+  for (auto& retKv : dailyReturns)
+  {
+    matrix.mCodes.push_back(retKv.first);
+    for (auto& dayRet : retKv.second)
+    {
+      size_t day = (dayRet.first - matrix.mFirstDate).days();
+      matrix.mReturns[fund * matrix.mNumDays + day] = dayRet.second;
+    }
+    ++fund;
+  }
+
+  cout << "Built return matrix of " << matrix.mCodes.size() << " funds x "
+       << matrix.mNumDays << " days" << endl;
+
+  return matrix;
+}
+
+vector<double>
+CalculateCorrelation(const ReturnMatrix& matrix, unsigned numThreads)
+{
+  // pairwise complete pearson correlation, i.e. only days on which both
+  // funds have a return are used for that pair
+  // n.sxy - sx.sy / sqrt((n.sxx - sx^2) (n.syy - sy^2))
+  // all six sums are accumulated in one pass over a tile of fund pairs,
+  // with the day axis also blocked so that both tiles stay in cache
+
+  const size_t FUND_TILE = 32;
+  const size_t DAY_TILE = 256;
+  const double MIN_COMMON_DAYS = 20;
+
+  const size_t num_funds = matrix.mCodes.size();
+  const size_t num_days = matrix.mNumDays;
+
+  cout << "Calculating correlation for " << num_funds
+       << " mutual funds using " << numThreads << " threads" << endl;
+
+  // values with NaN replaced by 0 and a matching 0/1 mask, so that the inner
+  // loop is branch free
+  vector<double> values(num_funds * num_days, 0);
+  vector<double> mask(num_funds * num_days, 0);
+  for (size_t k = 0; k < matrix.mReturns.size(); ++k)
+  {
+    if (!std::isnan(matrix.mReturns[k]))
+    {
+      values[k] = matrix.mReturns[k];
+      mask[k] = 1;
+    }
+  }
+
+  vector<double> corr(num_funds * num_funds,
+                      numeric_limits<double>::quiet_NaN());
+
+  const size_t num_tiles = (num_funds + FUND_TILE - 1) / FUND_TILE;
+  vector<pair<size_t, size_t>> tile_pairs;
+  for (size_t ti = 0; ti < num_tiles; ++ti)
+  {
+    for (size_t tj = ti; tj < num_tiles; ++tj)
+    {
+      tile_pairs.push_back(make_pair(ti, tj));
+    }
+  }
+
+  atomic<size_t> next_tile(0);
+
+  auto worker = [&]()
+  {
+    const size_t tile_sq = FUND_TILE * FUND_TILE;
+    vector<double> n(tile_sq), sx(tile_sq), sy(tile_sq);
+    vector<double> sxx(tile_sq), syy(tile_sq), sxy(tile_sq);
+
+    size_t t;
+    while ((t = next_tile++) < tile_pairs.size())
+    {
+      const size_t i_begin = tile_pairs[t].first * FUND_TILE;
+      const size_t i_end = min(i_begin + FUND_TILE, num_funds);
+      const size_t j_begin = tile_pairs[t].second * FUND_TILE;
+      const size_t j_end = min(j_begin + FUND_TILE, num_funds);
+
+      fill(n.begin(), n.end(), 0);
+      fill(sx.begin(), sx.end(), 0);
+      fill(sy.begin(), sy.end(), 0);
+      fill(sxx.begin(), sxx.end(), 0);
+      fill(syy.begin(), syy.end(), 0);
+      fill(sxy.begin(), sxy.end(), 0);
+
+      for (size_t d_begin = 0; d_begin < num_days; d_begin += DAY_TILE)
+      {
+        const size_t d_end = min(d_begin + DAY_TILE, num_days);
+
+        for (size_t i = i_begin; i < i_end; ++i)
+        {
+          const double* xi = &values[i * num_days];
+          const double* mi = &mask[i * num_days];
+
+          for (size_t j = max(i, j_begin); j < j_end; ++j)
+          {
+            const double* xj = &values[j * num_days];
+            const double* mj = &mask[j * num_days];
+
+            double a_n = 0, a_sx = 0, a_sy = 0;
+            double a_sxx = 0, a_syy = 0, a_sxy = 0;
+            for (size_t d = d_begin; d < d_end; ++d)
+            {
+              a_n += mi[d] * mj[d];
+              a_sx += xi[d] * mj[d];
+              a_sy += xj[d] * mi[d];
+              a_sxx += xi[d] * xi[d] * mj[d];
+              a_syy += xj[d] * xj[d] * mi[d];
+              a_sxy += xi[d] * xj[d];
+            }
+
+            const size_t k = (i - i_begin) * FUND_TILE + (j - j_begin);
+            n[k] += a_n;
+            sx[k] += a_sx;
+            sy[k] += a_sy;
+            sxx[k] += a_sxx;
+            syy[k] += a_syy;
+            sxy[k] += a_sxy;
+          }
+        }
+      }
+
+      for (size_t i = i_begin; i < i_end; ++i)
+      {
+        for (size_t j = max(i, j_begin); j < j_end; ++j)
+        {
+          const size_t k = (i - i_begin) * FUND_TILE + (j - j_begin);
+          if (n[k] < MIN_COMMON_DAYS)
+          {
+            continue;
+          }
+
+          double var_x = n[k] * sxx[k] - sx[k] * sx[k];
+          double var_y = n[k] * syy[k] - sy[k] * sy[k];
+          if (var_x <= 0 || var_y <= 0)
+          {
+            continue;
+          }
+
+          double r = (n[k] * sxy[k] - sx[k] * sy[k]) / sqrt(var_x * var_y);
+          r = max(-1.0, min(1.0, r));
+
+          corr[i * num_funds + j] = r;
+          corr[j * num_funds + i] = r;
+        }
+      }
+    }
+  };
+
+  vector<thread> threads;
+  for (unsigned t = 1; t < numThreads; ++t)
+  {
+    threads.push_back(thread(worker));
+  }
+  worker();
+  for (auto& t : threads)
+  {
+    t.join();
+  }
+
+  cout << "Calculated correlation for " << num_funds
+       << " mutual funds" << endl;
+
+  return corr;
+}
+
+void
+WriteCorrelation(const string& directory,
+                 const ReturnMatrix& matrix,
+                 const vector<double>& corr,
+                 bool binary)
+{
+  const size_t num_funds = matrix.mCodes.size();
+
+  if (binary)
+  {
+    // "MFCORR01", uint32 fund count, int64 codes, float32 matrix row major
+    string file_name = directory + "/correlation.bin";
+    cout << "Writing " << file_name << endl;
+
+    ofstream out(file_name.c_str(), ios::binary);
+    out.write("MFCORR01", 8);
+
+    uint32_t count = num_funds;
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    for (long code : matrix.mCodes)
+    {
+      int64_t c = code;
+      out.write(reinterpret_cast<const char*>(&c), sizeof(c));
+    }
+
+    vector<float> row(num_funds);
+    for (size_t i = 0; i < num_funds; ++i)
+    {
+      for (size_t j = 0; j < num_funds; ++j)
+      {
+        row[j] = corr[i * num_funds + j];
+      }
+      out.write(reinterpret_cast<const char*>(row.data()),
+                row.size() * sizeof(float));
+    }
+
+    out.close();
+  }
+  else
+  {
+    string file_name = directory + "/correlation.csv";
+    cout << "Writing " << file_name << endl;
+
+    ofstream out(file_name.c_str());
+    out << "Code";
+    for (long code : matrix.mCodes)
+    {
+      out << "," << code;
+    }
+    out << endl;
+
+    out << fixed << setprecision(4);
+    for (size_t i = 0; i < num_funds; ++i)
+    {
+      out << matrix.mCodes[i];
+      for (size_t j = 0; j < num_funds; ++j)
+      {
+        out << ",";
+        if (!std::isnan(corr[i * num_funds + j]))
+        {
+          out << corr[i * num_funds + j];
+        }
+      }
+      out << endl;
+    }
+
+    out.close();
+  }
+
+  cout << "Wrote correlation for " << num_funds << " mutual funds" << endl;
+}
+
+double
+SolveSipXirr(const vector<double>& years, double finalValue, double guess)
+{
+  // xirr r of paying 1 at each instalment and receiving finalValue at the
+  // end, i.e. the root of sum((1 + r)^years) - finalValue where years is the
+  // time from each instalment to the end; the sum is increasing in r, so
+  // newton converges from a nearby guess, with bisection as the fallback
+  const double MIN_RATE = -0.9999;
+  const double MAX_RATE = 100;
+  const double TOLERANCE = 1e-10;
+
+  auto value = [&](double rate, double& derivative)
+  {
+    double log_growth = log1p(rate);
+    double sum = 0;
+    derivative = 0;
+    for (double y : years)
+    {
+      double term = exp(y * log_growth);
+      sum += term;
+      derivative += y * term;
+    }
+    derivative /= 1 + rate;
+    return sum - finalValue;
+  };
+
+  double rate = min(max(guess, MIN_RATE), MAX_RATE);
+  for (int i = 0; i < 20; ++i)
+  {
+    double derivative;
+    double f = value(rate, derivative);
+    if (derivative <= 0)
+    {
+      break;
+    }
+
+    double next = rate - f / derivative;
+    if (next <= MIN_RATE || next >= MAX_RATE)
+    {
+      break;
+    }
+    if (fabs(next - rate) < TOLERANCE)
+    {
+      return next;
+    }
+    rate = next;
+  }
+
+  double low = MIN_RATE;
+  double high = MAX_RATE;
+  for (int i = 0; i < 200 && high - low > TOLERANCE; ++i)
+  {
+    double derivative;
+    double mid = (low + high) / 2;
+    if (value(mid, derivative) > 0)
+    {
+      high = mid;
+    }
+    else
+    {
+      low = mid;
+    }
+  }
+  return (low + high) / 2;
+}
+
+double
+SolveXirr(const vector<double>& years, const vector<double>& amounts,
+          double guess)
+{
+  // xirr r of cash flows paid (negative) or received (positive) years[i]
+  // before the valuation date, i.e. the root of sum(amounts * (1 + r)^years);
+  // newton from a nearby guess, with bisection as the fallback, and NaN if
+  // the flows do not bracket a root
+  const double MIN_RATE = -0.9999;
+  const double MAX_RATE = 100;
+  const double TOLERANCE = 1e-10;
+
+  auto value = [&](double rate, double& derivative)
+  {
+    double log_growth = log1p(rate);
+    double sum = 0;
+    derivative = 0;
+    for (size_t i = 0; i < years.size(); ++i)
+    {
+      double term = amounts[i] * exp(years[i] * log_growth);
+      sum += term;
+      derivative += years[i] * term;
+    }
+    derivative /= 1 + rate;
+    return sum;
+  };
+
+  double rate = std::isnan(guess) ? 0.1 : min(max(guess, MIN_RATE), MAX_RATE);
+  for (int i = 0; i < 20; ++i)
+  {
+    double derivative;
+    double f = value(rate, derivative);
+    if (derivative == 0)
+    {
+      break;
+    }
+
+    double next = rate - f / derivative;
+    if (next <= MIN_RATE || next >= MAX_RATE)
+    {
+      break;
+    }
+    if (fabs(next - rate) < TOLERANCE)
+    {
+      return next;
+    }
+    rate = next;
+  }
+
+  double derivative;
+  double low = MIN_RATE;
+  double high = MAX_RATE;
+  bool low_positive = value(low, derivative) > 0;
+  if (low_positive == (value(high, derivative) > 0))
+  {
+    return numeric_limits<double>::quiet_NaN();
+  }
+
+  for (int i = 0; i < 200 && high - low > TOLERANCE; ++i)
+  {
+    double mid = (low + high) / 2;
+    if ((value(mid, derivative) > 0) == low_positive)
+    {
+      low = mid;
+    }
+    else
+    {
+      high = mid;
+    }
+  }
+  return (low + high) / 2;
+}
+
+string
+CalculateSipXirr(const MutualFund& mf, const vector<int>& windowMonths)
+{
+  // XIRR of a monthly SIP of 1 started on every calendar day of the fund's
+  // history and redeemed one month after the last instalment. A start date
+  // and the dates a month, two months, ... later share the same instalment
+  // dates, so the start dates are grouped by day of month: each group is one
+  // monthly series whose prefix sums of units bought give the redemption
+  // value of any window in O(1), and each window's root finder starts from
+  // the previous window's xirr. Every root finder step still discounts all
+  // of the window's instalments at its own rate, which adjacent windows do
+  // not share, so the cost is O(start dates x instalments x steps) with
+  // typically a few steps per window.
+  const boost::gregorian::date first_date = mf.mData.mFirstDate;
+  const boost::gregorian::date last_date = mf.mData.LastDate();
+
+  const DailyColumn& nav_column = mf.mData.Get(MutualFundData::TYPE::NAV);
+  vector<double> navs(mf.mData.mNumDays);
+  for (size_t day = 0; day < navs.size(); ++day)
+  {
+    navs[day] = nav_column[day];
+  }
+
+  vector<vector<double>> xirrs(windowMonths.size());
+
+  vector<long> days;
+  vector<bool> is_start;
+  vector<double> units;
+  vector<double> years;
+
+  for (unsigned short dom = 1; dom <= 31; ++dom)
+  {
+    days.clear();
+    is_start.clear();
+    units.assign(1, 0);
+
+    for (boost::gregorian::date month(first_date.year(),
+                                      first_date.month(), 1);
+         month <= last_date;
+         month += boost::gregorian::months(1))
+    {
+      unsigned short last_dom =
+        boost::gregorian::gregorian_calendar::end_of_month_day(
+            month.year(), month.month());
+      boost::gregorian::date d(month.year(), month.month(),
+                               min(dom, last_dom));
+      if (d < first_date || d > last_date)
+      {
+        continue;
+      }
+
+      long day = (d - first_date).days();
+      days.push_back(day);
+      // an instalment clamped to the month end is not a distinct start date
+      is_start.push_back(dom <= last_dom);
+      units.push_back(units.back() + 1 / navs[day]);
+    }
+
+    for (size_t w = 0; w < windowMonths.size(); ++w)
+    {
+      const size_t n = windowMonths[w];
+      double guess = 0.1;
+
+      for (size_t j = 0; j + n < days.size(); ++j)
+      {
+        if (!is_start[j])
+        {
+          continue;
+        }
+
+        const long end_day = days[j + n];
+        const double final_value =
+          (units[j + n] - units[j]) * navs[end_day];
+
+        years.resize(n);
+        for (size_t k = 0; k < n; ++k)
+        {
+          years[k] = (end_day - days[j + k]) / 365.0;
+        }
+
+        guess = SolveSipXirr(years, final_value, guess);
+        xirrs[w].push_back(guess * 100);
+      }
+    }
+  }
+
+  ostringstream row;
+  row << fixed << setprecision(4) << mf.mCode;
+  for (auto& values : xirrs)
+  {
+    row << "," << values.size() << ",";
+    if (values.empty())
+    {
+      row << ",,";
+      continue;
+    }
+
+    sort(values.begin(), values.end());
+    double median = values.size() % 2 ?
+      values[values.size() / 2] :
+      (values[values.size() / 2 - 1] + values[values.size() / 2]) / 2;
+    row << values.front() << "," << median << "," << values.back();
+  }
+  row << "\n";
+
+  return row.str();
+}
+
+void
+CalculateSipXirr(const map<long, MutualFund>& mutualFunds,
+                 const vector<int>& windowMonths,
+                 unsigned numThreads,
+                 stringstream& sipXirr)
+{
+  cout << "Calculating SIP XIRR for " << mutualFunds.size()
+       << " mutual funds using " << numThreads << " threads" << endl;
+
+  vector<const MutualFund*> funds;
+  for (auto& mfKv : mutualFunds)
+  {
+    funds.push_back(&mfKv.second);
+  }
+
+  vector<string> rows(funds.size());
+  atomic<size_t> next_fund(0);
+
+  auto worker = [&]()
+  {
+    size_t f;
+    while ((f = next_fund++) < funds.size())
+    {
+      rows[f] = CalculateSipXirr(*funds[f], windowMonths);
+    }
+  };
+
+  vector<thread> threads;
+  for (unsigned t = 1; t < numThreads; ++t)
+  {
+    threads.push_back(thread(worker));
+  }
+  worker();
+  for (auto& t : threads)
+  {
+    t.join();
+  }
+
+  for (auto& row : rows)
+  {
+    sipXirr << row;
+  }
+
+  cout << "Calculated SIP XIRR for " << mutualFunds.size()
+       << " mutual funds" << endl;
+}
+
+void
+WriteSipXirr(const string& directory,
+             const vector<int>& windowMonths,
+             const stringstream& sipXirr)
+{
+  cout << "Writing CSV for SIP XIRR" << endl;
+
+  string file_name = directory + "/sip_xirr.csv";
+  ofstream out(file_name.c_str());
+
+  out << "Code";
+  for (int months : windowMonths)
+  {
+    out << "," << months << " Mnth SIP Count"
+        << "," << months << " Mnth SIP Min XIRR"
+        << "," << months << " Mnth SIP Median XIRR"
+        << "," << months << " Mnth SIP Max XIRR";
+  }
+  out << endl;
+
+  out << sipXirr.rdbuf();
+  out.close();
+
+  cout << "Wrote CSV for SIP XIRR" << endl;
+}
+
+class FundColumns
+{
+public:
+  typedef MutualFundData::TYPE COLUMN;
+
+  static const size_t NUM_COLUMNS = MutualFundData::NUM_TYPES;
+
+public:
+  // The columns of a fund's csv file, taken over from the fund once its
+  // statistics are calculated. The values are the ones written to the csv
+  // file, so the outputs across funds are calculated from the same values
+  // with either storage.
+  FundColumns(MutualFund&& mf, bool compact = false)
+    : mCode(mf.mCode),
+      mName(*mf.mName),
+      mCategory(*mf.mCategory),
+      mAmc(*mf.mAmc),
+      mData(move(mf.mData))
+  {
+    RoundToWritten(compact);
+  }
+
+  // from a record written by Write
+  FundColumns(istream& in, bool compact = false)
+  {
+    int64_t code;
+    int64_t first_day;
+    uint64_t num_days;
+    ReadValue(in, code);
+    mName = ReadString(in);
+    mCategory = ReadString(in);
+    mAmc = ReadString(in);
+    ReadValue(in, first_day);
+    ReadValue(in, num_days);
+    if (!in || num_days > MAX_DAYS)
+    {
+      throw runtime_error("Truncated fund columns");
+    }
+
+    mCode = code;
+    mData.mFirstDate = Epoch() + boost::gregorian::date_duration(first_day);
+    mData.mNumDays = num_days;
+    vector<double> values;
+    for (size_t c = 0; c < NUM_COLUMNS; ++c)
+    {
+      uint64_t column_first_day;
+      uint64_t num_values;
+      ReadValue(in, column_first_day);
+      ReadValue(in, num_values);
+      // a statistic the fund is too young for starts after its last day
+      if (!in || (num_values > 0 &&
+                  (column_first_day > num_days ||
+                   num_values > num_days - column_first_day)))
+      {
+        throw runtime_error("Truncated fund columns of MF code " +
+                            to_string(mCode));
+      }
+
+      values.resize(num_values);
+      in.read(reinterpret_cast<char*>(values.data()),
+              num_values * sizeof(double));
+
+      mData.Get(static_cast<COLUMN>(c)).Assign(column_first_day, values);
+    }
+    if (!in)
+    {
+      throw runtime_error("Truncated fund columns of MF code " +
+                          to_string(mCode));
+    }
+
+    RoundToWritten(compact);
+  }
+
+  FundColumns(const FundColumns&) = delete;
+  FundColumns& operator=(const FundColumns&) = delete;
+
+  // every value as held, in the byte order of this machine, for the merge
+  // of shards
+  void Write(ostream& out) const
+  {
+    const int64_t code = mCode;
+    const int64_t first_day = (mData.mFirstDate - Epoch()).days();
+    const uint64_t num_days = mData.mNumDays;
+    WriteValue(out, code);
+    WriteString(out, mName);
+    WriteString(out, mCategory);
+    WriteString(out, mAmc);
+    WriteValue(out, first_day);
+    WriteValue(out, num_days);
+
+    vector<double> values;
+    for (size_t c = 0; c < NUM_COLUMNS; ++c)
+    {
+      const DailyColumn& column = mData.Get(static_cast<COLUMN>(c));
+      const uint64_t column_first_day = column.FirstDay();
+      const uint64_t num_values = column.EndDay() - column.FirstDay();
+      WriteValue(out, column_first_day);
+      WriteValue(out, num_values);
+
+      values.resize(num_values);
+      for (size_t day = column.FirstDay(); day < column.EndDay(); ++day)
+      {
+        values[day - column.FirstDay()] = column[day];
+      }
+      out.write(reinterpret_cast<const char*>(values.data()),
+                num_values * sizeof(double));
+    }
+  }
+
+  static bool ParseColumn(const string& name, COLUMN& column)
+  {
+    for (size_t c = 0; c < NUM_COLUMNS; ++c)
+    {
+      if (name == ColumnName(static_cast<COLUMN>(c)))
+      {
+        column = static_cast<COLUMN>(c);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static const char* ColumnName(COLUMN column)
+  {
+    switch (column)
+    {
+      case COLUMN::NAV:
+        return "nav";
+
+      case COLUMN::ONE_MNTH_NAV_AVG:
+        return "1m_avg";
+
+      case COLUMN::ONE_YR_NAV_CAGR:
+        return "1y_cagr";
+      case COLUMN::THREE_YR_NAV_CAGR:
+        return "3y_cagr";
+      case COLUMN::FIVE_YR_NAV_CAGR:
+        return "5y_cagr";
+
+      case COLUMN::TWO_YR_STD_DEV_OF_ONE_YR_NAV_CAGR:
+        return "2y_sd";
+      case COLUMN::FOUR_YR_STD_DEV_OF_ONE_YR_NAV_CAGR:
+        return "4y_sd";
+
+      default:
+        assert(false);
+    }
+  }
+
+  size_t NumDays() const
+  {
+    return mData.mNumDays;
+  }
+
+  // heap memory of the values
+  size_t Bytes() const
+  {
+    return mData.Bytes();
+  }
+
+  boost::gregorian::date FirstDate() const
+  {
+    return mData.mFirstDate;
+  }
+
+  boost::gregorian::date LastDate() const
+  {
+    return mData.LastDate();
+  }
+
+  // NaN where the fund has no value of the column on the date
+  double Get(COLUMN column, const boost::gregorian::date& date) const
+  {
+    if (date < mData.mFirstDate)
+    {
+      return numeric_limits<double>::quiet_NaN();
+    }
+
+    const size_t day = (date - mData.mFirstDate).days();
+    const DailyColumn& values = mData.Get(column);
+    if (!values.Has(day))
+    {
+      return numeric_limits<double>::quiet_NaN();
+    }
+
+    return values[day];
+  }
+
+  void FormatRow(ostream& out, size_t day) const
+  {
+    mData.FormatRow(out, day);
+  }
+
+  // same content as the fund's csv file, formatted on first use
+  const string& Csv() const
+  {
+    call_once(mCsvOnce, [this]()
+    {
+      ostringstream out;
+      out << fixed << setprecision(4);
+      for (size_t day = 0; day < NumDays(); ++day)
+      {
+        FormatRow(out, day);
+        out << "\n";
+      }
+      mCsv = out.str();
+    });
+
+    return mCsv;
+  }
+
+private:
+  static boost::gregorian::date Epoch()
+  {
+    return boost::gregorian::date(1970, 1, 1);
+  }
+
+  template <typename T>
+  static void ReadValue(istream& in, T& value)
+  {
+    in.read(reinterpret_cast<char*>(&value), sizeof(value));
+  }
+
+  template <typename T>
+  static void WriteValue(ostream& out, const T& value)
+  {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  static string ReadString(istream& in)
+  {
+    uint32_t size = 0;
+    ReadValue(in, size);
+    string value(in ? size : 0, '\0');
+    in.read(&value[0], value.size());
+    return value;
+  }
+
+  static void WriteString(ostream& out, const string& value)
+  {
+    const uint32_t size = value.size();
+    WriteValue(out, size);
+    out.write(value.data(), value.size());
+  }
+
+  void RoundToWritten(bool compact)
+  {
+    for (size_t c = 0; c < NUM_COLUMNS; ++c)
+    {
+      const COLUMN column = static_cast<COLUMN>(c);
+      mData.Get(column).RoundToWritten();
+      if (compact)
+      {
+        mData.Compact(column);
+      }
+    }
+  }
+
+public:
+  long mCode;
+  string mName;
+  string mCategory;
+  string mAmc;
+
+private:
+  static const uint64_t MAX_DAYS = 1 << 20;
+
+  MutualFundData mData;
+
+  mutable once_flag mCsvOnce;
+  mutable string mCsv;
+};
+
+class CategoryStatistics
+{
+public:
+  // Per category, per date distribution of the return and risk statistics
+  // of the category's funds, and each fund's percentile rank within it.
+  // Categories are independent, so they are processed in parallel with
+  // every thread writing its own category's files.
+  CategoryStatistics(const vector<shared_ptr<const FundColumns>>& funds)
+  {
+    for (auto& fund : funds)
+    {
+      const string& category = fund->mCategory.empty() ?
+        UNCATEGORISED : fund->mCategory;
+      mCategories[category].push_back(fund.get());
+    }
+  }
+
+  CategoryStatistics(const CategoryStatistics&) = delete;
+  CategoryStatistics& operator=(const CategoryStatistics&) = delete;
+
+  void Write(const string& directory, unsigned numThreads)
+  {
+    cout << "Calculating statistics for " << mCategories.size()
+         << " categories using " << numThreads << " threads" << endl;
+
+    string category_dir = directory + "/category";
+    mkdir(category_dir.c_str(), 0755);
+
+    WriteFormat(category_dir);
+
+    vector<const pair<const string, vector<const FundColumns*>>*> categories;
+    {
+      string file_name = directory + "/categories.csv";
+      ofstream out(file_name.c_str());
+      for (auto& categoryKv : mCategories)
+      {
+        out << ToSlug(categoryKv.first) << ","
+            << categoryKv.first << ","
+            << categoryKv.second.size() << endl;
+        categories.push_back(&categoryKv);
+      }
+      out.close();
+    }
+
+    atomic<size_t> next_category(0);
+    auto worker = [&]()
+    {
+      size_t c;
+      while ((c = next_category++) < categories.size())
+      {
+        WriteCategory(category_dir,
+                      ToSlug(categories[c]->first),
+                      categories[c]->second);
+      }
+    };
+
+    vector<thread> threads;
+    for (unsigned t = 1; t < numThreads; ++t)
+    {
+      threads.push_back(thread(worker));
+    }
+    worker();
+    for (auto& t : threads)
+    {
+      t.join();
+    }
+
+    cout << "Calculated statistics for " << mCategories.size()
+         << " categories" << endl;
+  }
+
+private:
+  static const vector<FundColumns::COLUMN>& Columns()
+  {
+    static const vector<FundColumns::COLUMN> columns =
+    {
+      FundColumns::COLUMN::ONE_YR_NAV_CAGR,
+      FundColumns::COLUMN::THREE_YR_NAV_CAGR,
+      FundColumns::COLUMN::FIVE_YR_NAV_CAGR,
+      FundColumns::COLUMN::TWO_YR_STD_DEV_OF_ONE_YR_NAV_CAGR,
+      FundColumns::COLUMN::FOUR_YR_STD_DEV_OF_ONE_YR_NAV_CAGR,
+    };
+    return columns;
+  }
+
+  static double Quantile(const vector<pair<double, size_t>>& sorted,
+                         double q)
+  {
+    // linear interpolation between the closest ranks
+    double pos = q * (sorted.size() - 1);
+    size_t lower = static_cast<size_t>(pos);
+    size_t upper = min(lower + 1, sorted.size() - 1);
+    return sorted[lower].first +
+      (pos - lower) * (sorted[upper].first - sorted[lower].first);
+  }
+
+  static void WriteFormat(const string& categoryDir)
+  {
+    string file_name = categoryDir + "/format.csv";
+    ofstream out(file_name.c_str());
+
+    out << "Date,";
+    for (auto column : Columns())
+    {
+      const char* name = FundColumns::ColumnName(column);
+      out << name << " Count,"
+          << name << " 1st Quartile,"
+          << name << " Median,"
+          << name << " 3rd Quartile,";
+    }
+    out << endl;
+
+    out << "Date,Code,";
+    for (auto column : Columns())
+    {
+      out << FundColumns::ColumnName(column) << " Percentile Rank,";
+    }
+    out << endl;
+
+    out.close();
+  }
+
+  static void WriteCategory(const string& categoryDir,
+                            const string& slug,
+                            const vector<const FundColumns*>& funds)
+  {
+    // <slug>.csv       date, then count,q1,median,q3 of every column
+    // <slug>_ranks.csv date,code, then the fund's percentile rank in every
+    //                  column, i.e. the percentage of the category's funds
+    //                  with a value at or below the fund's
+    const size_t num_columns = Columns().size();
+
+    boost::gregorian::date first_date = funds.front()->FirstDate();
+    boost::gregorian::date last_date = funds.front()->LastDate();
+    for (auto fund : funds)
+    {
+      first_date = min(first_date, fund->FirstDate());
+      last_date = max(last_date, fund->LastDate());
+    }
+
+    ostringstream aggregates;
+    ostringstream ranks;
+    aggregates << fixed << setprecision(4);
+    ranks << fixed << setprecision(4);
+
+    vector<pair<double, size_t>> values;
+    vector<double> fund_ranks(funds.size() * num_columns);
+
+    for (boost::gregorian::date d = first_date;
+         d <= last_date;
+         d += boost::gregorian::date_duration(1))
+    {
+      fill(fund_ranks.begin(), fund_ranks.end(),
+           numeric_limits<double>::quiet_NaN());
+      bool any_value = false;
+
+      ostringstream row;
+      row << fixed << setprecision(4) << to_iso_extended_string(d);
+
+      for (size_t c = 0; c < num_columns; ++c)
+      {
+        values.clear();
+        for (size_t f = 0; f < funds.size(); ++f)
+        {
+          double value = funds[f]->Get(Columns()[c], d);
+          if (!std::isnan(value))
+          {
+            values.push_back(make_pair(value, f));
+          }
+        }
+
+        row << "," << values.size() << ",";
+        if (values.empty())
+        {
+          row << ",,";
+          continue;
+        }
+        any_value = true;
+
+        sort(values.begin(), values.end());
+        row << Quantile(values, 0.25) << ","
+            << Quantile(values, 0.5) << ","
+            << Quantile(values, 0.75);
+
+        // equal values share the rank of the last of them
+        for (size_t i = 0; i < values.size(); )
+        {
+          size_t j = i;
+          while (j + 1 < values.size() &&
+                 values[j + 1].first == values[i].first)
+          {
+            ++j;
+          }
+
+          double rank = 100.0 * (j + 1) / values.size();
+          for (size_t k = i; k <= j; ++k)
+          {
+            fund_ranks[values[k].second * num_columns + c] = rank;
+          }
+          i = j + 1;
+        }
+      }
+
+      if (!any_value)
+      {
+        continue;
+      }
+
+      aggregates << row.str() << "\n";
+
+      for (size_t f = 0; f < funds.size(); ++f)
+      {
+        bool has_rank = false;
+        for (size_t c = 0; c < num_columns; ++c)
+        {
+          has_rank = has_rank || !std::isnan(fund_ranks[f * num_columns + c]);
+        }
+        if (!has_rank)
+        {
+          continue;
+        }
+
+        ranks << to_iso_extended_string(d) << "," << funds[f]->mCode;
+        for (size_t c = 0; c < num_columns; ++c)
+        {
+          ranks << ",";
+          if (!std::isnan(fund_ranks[f * num_columns + c]))
+          {
+            ranks << fund_ranks[f * num_columns + c];
+          }
+        }
+        ranks << "\n";
+      }
+    }
+
+    string file_name = categoryDir + "/" + slug + ".csv";
+    ofstream out(file_name.c_str());
+    out << aggregates.str();
+    out.close();
+
+    string ranks_file_name = categoryDir + "/" + slug + "_ranks.csv";
+    ofstream ranks_out(ranks_file_name.c_str());
+    ranks_out << ranks.str();
+    ranks_out.close();
+  }
+
+private:
+  static const string UNCATEGORISED;
+
+  map<string, vector<const FundColumns*>> mCategories;
+};
+
+const string CategoryStatistics::UNCATEGORISED = "Uncategorised";
+
+class Backtest
+{
+public:
+  class Variant
+  {
+  public:
+    // 3y_cagr_top10_2y_sd_1m, 3y_cagr_top10_hold
+    string Name() const
+    {
+      ostringstream name;
+      name << FundColumns::ColumnName(mRank) << "_top" << mHoldings;
+      if (mHasRisk)
+      {
+        name << "_" << FundColumns::ColumnName(mRisk);
+      }
+      if (mRebalanceMonths > 0)
+      {
+        name << "_" << mRebalanceMonths << "m";
+      }
+      else
+      {
+        name << "_hold";
+      }
+      return name.str();
+    }
+
+  public:
+    // the funds ranked best by mRank, or if mHasRisk the half of the best
+    // 2 * mHoldings with the lowest mRisk, held in equal amounts
+    FundColumns::COLUMN mRank;
+    bool mHasRisk;
+    FundColumns::COLUMN mRisk;
+    size_t mHoldings;
+
+    // 0 holds the first selection for good
+    int mRebalanceMonths;
+  };
+
+public:
+  // Simulates screening rules on the funds' statistics with a monthly SIP
+  // invested on the first of every month, equally into the current holdings
+  // or, on a rebalance, by trading every holding to an equal share of the
+  // portfolio. The cross-sectional rank of every rank column on every first
+  // of the month is computed once and shared by all variants, which then run
+  // in parallel on the same columns.
+  Backtest(const vector<shared_ptr<const FundColumns>>& funds,
+           const vector<Variant>& variants)
+    : mVariants(variants)
+  {
+    for (auto& fund : funds)
+    {
+      mFunds.push_back(fund.get());
+    }
+    if (mFunds.empty())
+    {
+      return;
+    }
+
+    mFirstDate = mFunds.front()->FirstDate();
+    mLastDate = mFunds.front()->LastDate();
+    for (auto fund : mFunds)
+    {
+      mFirstDate = min(mFirstDate, fund->FirstDate());
+      mLastDate = max(mLastDate, fund->LastDate());
+    }
+
+    boost::gregorian::date month(mFirstDate.year(), mFirstDate.month(), 1);
+    if (month < mFirstDate)
+    {
+      month += boost::gregorian::months(1);
+    }
+    for (; month <= mLastDate; month += boost::gregorian::months(1))
+    {
+      mMonths.push_back(month);
+    }
+
+    for (auto& variant : mVariants)
+    {
+      vector<vector<size_t>>& ranking =
+        mRankings[static_cast<size_t>(variant.mRank)];
+      if (ranking.empty())
+      {
+        Rank(variant.mRank, ranking);
+      }
+    }
+  }
+
+  Backtest(const Backtest&) = delete;
+  Backtest& operator=(const Backtest&) = delete;
+
+  void Run(const string& directory, unsigned numThreads)
+  {
+    cout << "Backtesting " << mVariants.size() << " variants on "
+         << mFunds.size() << " mutual funds using " << numThreads
+         << " threads" << endl;
+
+    string backtest_dir = directory + "/backtest";
+    mkdir(backtest_dir.c_str(), 0755);
+
+    vector<string> summaries(mVariants.size());
+    atomic<size_t> next_variant(0);
+    auto worker = [&]()
+    {
+      size_t v;
+      while ((v = next_variant++) < mVariants.size())
+      {
+        summaries[v] = Simulate(mVariants[v], backtest_dir);
+      }
+    };
+
+    vector<thread> threads;
+    for (unsigned t = 1; t < numThreads; ++t)
+    {
+      threads.push_back(thread(worker));
+    }
+    worker();
+    for (auto& t : threads)
+    {
+      t.join();
+    }
+
+    string file_name = directory + "/backtest.csv";
+    ofstream out(file_name.c_str());
+    out << "Variant,Rank,Risk,Holdings,Rebalance Months,"
+        << "Start Date,End Date,Total Cost,Total Value,XIRR,"
+        << "Rebalances,Trades" << endl;
+    for (auto& summary : summaries)
+    {
+      out << summary;
+    }
+    out.close();
+
+    cout << "Backtested " << mVariants.size() << " variants" << endl;
+  }
+
+private:
+  class Holding
+  {
+  public:
+    Holding()
+      : mUnits(0),
+        mCost(0),
+        mXirr(numeric_limits<double>::quiet_NaN())
+    {
+    }
+
+  public:
+    double mUnits;
+    double mCost;
+
+    // days since the backtest's first date and amounts of every trade
+    vector<double> mFlowDays;
+    vector<double> mFlowAmounts;
+    double mXirr;
+  };
+
+  class Trade
+  {
+  public:
+    const char* mAction;
+    double mUnits;
+    double mNav;
+    double mAmount;
+  };
+
+  static bool LowerIsBetter(FundColumns::COLUMN column)
+  {
+    return column == FundColumns::COLUMN::TWO_YR_STD_DEV_OF_ONE_YR_NAV_CAGR ||
+           column == FundColumns::COLUMN::FOUR_YR_STD_DEV_OF_ONE_YR_NAV_CAGR;
+  }
+
+  void Rank(FundColumns::COLUMN column, vector<vector<size_t>>& ranking) const
+  {
+    // funds with a value on the first of each month, best first, ties in
+    // code order
+    const bool ascending = LowerIsBetter(column);
+    ranking.resize(mMonths.size());
+
+    vector<pair<double, size_t>> values;
+    for (size_t m = 0; m < mMonths.size(); ++m)
+    {
+      values.clear();
+      for (size_t f = 0; f < mFunds.size(); ++f)
+      {
+        double value = mFunds[f]->Get(column, mMonths[m]);
+        if (!std::isnan(value))
+        {
+          values.push_back(make_pair(ascending ? value : -value, f));
+        }
+      }
+
+      sort(values.begin(), values.end());
+      for (auto& value : values)
+      {
+        ranking[m].push_back(value.second);
+      }
+    }
+  }
+
+  vector<size_t> Select(const Variant& variant, size_t month) const
+  {
+    const vector<size_t>& ranked =
+      mRankings[static_cast<size_t>(variant.mRank)][month];
+
+    // in fund order
+    vector<size_t> selection;
+    if (!variant.mHasRisk)
+    {
+      selection.assign(ranked.begin(),
+                       ranked.begin() + min(variant.mHoldings, ranked.size()));
+      sort(selection.begin(), selection.end());
+      return selection;
+    }
+
+    vector<pair<double, size_t>> shortlist;
+    for (size_t i = 0; i < ranked.size() &&
+                       i < 2 * variant.mHoldings; ++i)
+    {
+      double risk = mFunds[ranked[i]]->Get(variant.mRisk, mMonths[month]);
+      if (!std::isnan(risk))
+      {
+        shortlist.push_back(make_pair(risk, ranked[i]));
+      }
+    }
+
+    stable_sort(shortlist.begin(), shortlist.end(),
+                [](const pair<double, size_t>& a,
+                   const pair<double, size_t>& b)
+                {
+                  return a.first < b.first;
+                });
+
+    for (size_t i = 0; i < shortlist.size() && i < variant.mHoldings; ++i)
+    {
+      selection.push_back(shortlist[i].second);
+    }
+    sort(selection.begin(), selection.end());
+    return selection;
+  }
+
+  double Nav(size_t fund, const boost::gregorian::date& date) const
+  {
+    // a fund that stopped reporting keeps its last NAV until it is sold
+    const FundColumns& columns = *mFunds[fund];
+    return columns.Get(FundColumns::COLUMN::NAV,
+                       min(date, columns.LastDate()));
+  }
+
+  string Simulate(const Variant& variant, const string& directory) const
+  {
+    // <name>.csv in the transactions.csv format charted by portfolio.js,
+    // date,code,action,units,nav,amount,total units,total cost,value,xirr
+    // for every holding on every day, followed by the portfolio's
+    // date,,,,,,,total cost,value,xirr
+    const double SIP_AMOUNT = 10000;
+    const string name = variant.Name();
+
+    ostringstream out;
+    out << fixed << setprecision(4);
+    out << "Date,MF Code,Action,Units,Nav,Cost,"
+        << "Total Units,Total Cost,Total Value,XIRR" << endl;
+
+    map<size_t, Holding> holdings;
+    vector<double> sip_days;
+    vector<double> sip_amounts;
+    double total_cost = 0;
+    double total_value = 0;
+    double xirr = numeric_limits<double>::quiet_NaN();
+    int months_since_rebalance = 0;
+    int num_rebalances = 0;
+    int num_trades = 0;
+
+    vector<double> years;
+    vector<double> amounts;
+    map<size_t, Trade> trades;
+
+    auto trade = [&](size_t fund, double amount, double nav, long day)
+    {
+      // positive amounts buy, negative amounts sell
+      Holding& holding = holdings[fund];
+      double units = amount / nav;
+      if (amount < 0)
+      {
+        if (-units >= holding.mUnits * (1 - 1e-12))
+        {
+          units = -holding.mUnits;
+          amount = units * nav;
+        }
+        holding.mCost += holding.mCost * units / holding.mUnits;
+      }
+      else
+      {
+        holding.mCost += amount;
+      }
+      holding.mUnits += units;
+      holding.mFlowDays.push_back(day);
+      holding.mFlowAmounts.push_back(-amount);
+      trades[fund] = Trade{ amount < 0 ? "SELL" : "BUY",
+                            fabs(units), nav, fabs(amount) };
+      ++num_trades;
+    };
+
+    auto solve = [&](const vector<double>& flowDays,
+                     const vector<double>& flowAmounts,
+                     double value, long day, double guess)
+    {
+      years.clear();
+      amounts.clear();
+      for (size_t i = 0; i < flowDays.size(); ++i)
+      {
+        years.push_back((day - flowDays[i]) / 365.0);
+        amounts.push_back(flowAmounts[i]);
+      }
+      years.push_back(0);
+      amounts.push_back(value);
+      return SolveXirr(years, amounts, guess);
+    };
+
+    boost::gregorian::date start_date(boost::gregorian::not_a_date_time);
+    size_t month = 0;
+    for (boost::gregorian::date d = mMonths.empty() ?
+           mLastDate + boost::gregorian::date_duration(1) : mMonths[0];
+         d <= mLastDate;
+         d += boost::gregorian::date_duration(1))
     {
-      vector<string> fields = Split(line, ";");
-      if (fields.size() == 6 &&
-          !fields.at(0).empty() && // code
-          !fields.at(1).empty() && // name
-          !fields.at(2).empty() && // nav
-          !fields.at(5).empty())   // date
+      const long day = (d - mFirstDate).days();
+      trades.clear();
+
+      if (month < mMonths.size() && d == mMonths[month])
       {
-        long code;
+        if (!holdings.empty())
+        {
+          ++months_since_rebalance;
+        }
 
-        try
+        vector<size_t> selection;
+        if (holdings.empty() ||
+            (variant.mRebalanceMonths > 0 &&
+             months_since_rebalance >= variant.mRebalanceMonths))
         {
-          // silently fail
-          if (fields.at(0) == "Scheme Code")
+          selection = Select(variant, month);
+        }
+
+        if (!selection.empty())
+        {
+          double value = SIP_AMOUNT;
+          for (auto& holdingKv : holdings)
           {
-            continue;
+            value += holdingKv.second.mUnits * Nav(holdingKv.first, d);
           }
+          const double target = value / selection.size();
 
-          // remove leading and trailing whitespaces
-          fields.at(0).erase(0, fields.at(0).find_first_not_of(" \t\r\n"));
-          fields.at(0).erase(fields.at(0).find_last_not_of(" \t\r\n") + 1);
+          // sell what is no longer selected first, then trade the rest to
+          // equal shares
+          vector<size_t> sold;
+          for (auto& holdingKv : holdings)
+          {
+            if (!binary_search(selection.begin(), selection.end(),
+                               holdingKv.first))
+            {
+              sold.push_back(holdingKv.first);
+            }
+          }
+          for (size_t fund : sold)
+          {
+            double nav = Nav(fund, d);
+            trade(fund, -holdings[fund].mUnits * nav, nav, day);
+          }
+          for (size_t fund : selection)
+          {
+            double nav = Nav(fund, d);
+            auto it = holdings.find(fund);
+            double current = it == holdings.end() ?
+              0 : it->second.mUnits * nav;
+            if (fabs(target - current) >= 0.00005)
+            {
+              trade(fund, target - current, nav, day);
+            }
+          }
 
-          if (fields.at(0).find_first_not_of("0123456789") !=
-              std::string::npos)
+          if (start_date.is_not_a_date())
           {
-            throw exception();
+            start_date = d;
+          }
+          months_since_rebalance = 0;
+          ++num_rebalances;
+          sip_days.push_back(day);
+          sip_amounts.push_back(-SIP_AMOUNT);
+          total_cost += SIP_AMOUNT;
+        }
+        else if (!holdings.empty())
+        {
+          // the SIP goes to the holdings that still report NAVs
+          vector<size_t> active;
+          for (auto& holdingKv : holdings)
+          {
+            if (d <= mFunds[holdingKv.first]->LastDate())
+            {
+              active.push_back(holdingKv.first);
+            }
+          }
+          for (size_t fund : active)
+          {
+            trade(fund, SIP_AMOUNT / active.size(), Nav(fund, d), day);
+          }
+          if (!active.empty())
+          {
+            sip_days.push_back(day);
+            sip_amounts.push_back(-SIP_AMOUNT);
+            total_cost += SIP_AMOUNT;
           }
+        }
 
-          code = stol(fields.at(0));
+        ++month;
+      }
+
+      if (holdings.empty())
+      {
+        continue;
+      }
+
+      total_value = 0;
+      const string date = to_iso_extended_string(d);
+      for (auto it = holdings.begin(); it != holdings.end(); )
+      {
+        Holding& holding = it->second;
+        const double nav = Nav(it->first, d);
+        const double value = holding.mUnits * nav;
+        total_value += value;
+        holding.mXirr = solve(holding.mFlowDays, holding.mFlowAmounts,
+                              value, day, holding.mXirr);
+
+        out << date << "," << mFunds[it->first]->mCode << ",";
+        auto trade_it = trades.find(it->first);
+        if (trade_it != trades.end())
+        {
+          const Trade& t = trade_it->second;
+          out << t.mAction << "," << t.mUnits << "," << t.mNav << ","
+              << t.mAmount << ",";
         }
-        catch (const exception& e)
+        else
         {
-          cout << "Dropping: " << line << endl;
-          continue;
+          out << ",,,,";
+        }
+        out << holding.mUnits << "," << holding.mCost << "," << value << ",";
+        if (!std::isnan(holding.mXirr))
+        {
+          out << holding.mXirr * 100;
         }
+        out << "\n";
 
-        mf_codes.insert(code);
+        // a holding sold in full is dropped after its last row
+        if (holding.mUnits == 0)
+        {
+          it = holdings.erase(it);
+        }
+        else
+        {
+          ++it;
+        }
+      }
+
+      xirr = solve(sip_days, sip_amounts, total_value, day, xirr);
+      out << date << ",,,,,,," << total_cost << "," << total_value << ",";
+      if (!std::isnan(xirr))
+      {
+        out << xirr * 100;
+      }
+      out << "\n";
+    }
+
+    string file_name = directory + "/" + name + ".csv";
+    ofstream file(file_name.c_str());
+    file << out.str();
+    file.close();
+
+    ostringstream summary;
+    summary << fixed << setprecision(4)
+            << name << ","
+            << FundColumns::ColumnName(variant.mRank) << ","
+            << (variant.mHasRisk ?
+                FundColumns::ColumnName(variant.mRisk) : "") << ","
+            << variant.mHoldings << ","
+            << variant.mRebalanceMonths << ",";
+    if (start_date.is_not_a_date())
+    {
+      summary << ",,,,,";
+    }
+    else
+    {
+      summary << to_iso_extended_string(start_date) << ","
+              << to_iso_extended_string(mLastDate) << ","
+              << total_cost << "," << total_value << ",";
+      if (!std::isnan(xirr))
+      {
+        summary << xirr * 100;
       }
     }
+    summary << "," << num_rebalances << "," << num_trades << "\n";
+    return summary.str();
   }
 
-  long min_mf_code = *mf_codes.begin();
-  long max_mf_code = *mf_codes.rbegin();
+private:
+  vector<const FundColumns*> mFunds;
+  vector<Variant> mVariants;
+  boost::gregorian::date mFirstDate;
+  boost::gregorian::date mLastDate;
+
+  // first of every month and, per rank column, the fund indexes ranked on it
+  vector<boost::gregorian::date> mMonths;
+  vector<vector<size_t>> mRankings[FundColumns::NUM_COLUMNS];
+};
 
-  cout << "Read " << mf_codes.size() << " mutual funds"
-       << " with minimum MF Code " << min_mf_code
-       << " and maximum MF Code " << max_mf_code
-       << endl;
+class NavStore
+{
+private:
+  typedef map<long, shared_ptr<const FundColumns>> FundMap;
 
-  return make_tuple(min_mf_code, max_mf_code);
-}
+public:
+  // Keeps every fund's NAV and statistics in memory for the daemon mode.
+  // The parsed NAVs of each file are retained so that a changed file only
+  // requires the funds it contains (before or after the change) to be merged
+  // and recalculated. Queries take a reference counted snapshot of the funds
+  // under the lock and then run without it, so a reload never blocks them
+  // for longer than the swap.
+  NavStore(const string& navDir, bool useUring, bool compact)
+    : mNavDir(navDir),
+      mCompact(compact),
+      mpIo(CreateFileIo(useUring)),
+      mpFunds(make_shared<const FundMap>())
+  {
+  }
 
-map<long, MutualFund>
-ReadMFData(stringstream& rawMfData,
-           long startingMfCode, long endingMfCode)
-{
-  cout << "Reading MF Data"
-       << " with MF Codes between " << startingMfCode
-       << " and " << endingMfCode << endl;
+  NavStore(const NavStore&) = delete;
+  NavStore& operator=(const NavStore&) = delete;
 
-  map<long, MutualFund> mutual_funds;
-  int num_nav = 0;
-  string line;
+  void LoadAll()
+  {
+    set<long> codes;
+    for (auto& file_name : GetNavFileNames(mNavDir))
+    {
+      ReadFile(file_name, codes);
+    }
+    Rebuild(codes);
+  }
 
-  rawMfData.clear();
-  rawMfData.seekg(0, rawMfData.beg);
-  while (getline(rawMfData, line))
+  void ReloadFile(const string& fileName)
   {
-    if (line.size() > 0)
+    cout << "Reloading " << fileName << endl;
+
+    set<long> codes;
+    auto it = mFileFunds.find(fileName);
+    if (it != mFileFunds.end())
     {
-      vector<string> fields = Split(line, ";");
-      if (fields.size() == 6 &&
-          !fields.at(0).empty() && // code
-          !fields.at(1).empty() && // name
-          !fields.at(2).empty() && // nav
-          !fields.at(5).empty())   // date
+      for (auto& mfKv : it->second.mFunds)
       {
-        long code;
-        string name;
-        double nav_value;
-        boost::gregorian::date nav_date;
+        codes.insert(mfKv.first);
+      }
+      mFileFunds.erase(it);
+    }
 
-        try
+    ifstream exists(fileName.c_str());
+    if (exists.good())
+    {
+      exists.close();
+      ReadFile(fileName, codes);
+    }
+
+    Rebuild(codes);
+  }
+
+  string Query(const string& request) const
+  {
+    vector<string> args = Split(request, " ");
+
+    shared_ptr<const FundMap> funds_ptr;
+    boost::gregorian::date last_date;
+    {
+      lock_guard<mutex> lock(mMutex);
+      funds_ptr = mpFunds;
+      last_date = mLastDate;
+    }
+    const FundMap& funds = *funds_ptr;
+
+    ostringstream out;
+    out << fixed << setprecision(4);
+
+    try
+    {
+      if (args.at(0) == "SERIES" && args.size() == 2)
+      {
+        auto it = funds.find(stol(args.at(1)));
+        if (it == funds.end())
         {
-          // silently fail
-          if (fields.at(0) == "Scheme Code")
-          {
-            continue;
-          }
+          return "ERROR unknown mutual fund\n";
+        }
+        return "OK\n" + it->second->Csv();
+      }
+      else if (args.at(0) == "SNAPSHOT" && args.size() <= 2)
+      {
+        boost::gregorian::date date = args.size() == 2 ?
+          boost::gregorian::from_simple_string(args.at(1)) : last_date;
 
-          // silently fail
-          if (fields.at(2) == "NA" ||
-              fields.at(2) == "N.A." ||
-              fields.at(2) == "N/A" ||
-              fields.at(2) == "#N/A" ||
-              fields.at(2) == "#DIV/0!" ||
-              fields.at(2) == "B.C." ||
-              fields.at(2) == "B. C." ||
-              fields.at(2) == "-")
+        out << "OK\n";
+        for (auto& fundKv : funds)
+        {
+          const FundColumns& fund = *fundKv.second;
+          if (date < fund.FirstDate() || date > fund.LastDate())
           {
             continue;
           }
 
-          // remove leading and trailing whitespaces
-          fields.at(0).erase(0, fields.at(0).find_first_not_of(" \t\r\n"));
-          fields.at(0).erase(fields.at(0).find_last_not_of(" \t\r\n") + 1);
-          fields.at(1).erase(0, fields.at(1).find_first_not_of(" \t\r\n"));
-          fields.at(1).erase(fields.at(1).find_last_not_of(" \t\r\n") + 1);
-          fields.at(2).erase(0, fields.at(2).find_first_not_of(" \t"));
-          fields.at(2).erase(fields.at(2).find_last_not_of(" \t") + 1);
-          fields.at(5).erase(0, fields.at(5).find_first_not_of(" \t\r\n"));
-          fields.at(5).erase(fields.at(5).find_last_not_of(" \t\r\n") + 1);
-
-          // remove " ' , \t \n from name
-          fields.at(1).erase(remove(fields.at(1).begin(),
-                                    fields.at(1).end(),
-                                    '\"'),
-                             fields.at(1).end());
-          fields.at(1).erase(remove(fields.at(1).begin(),
-                                    fields.at(1).end(),
-                                    '\''),
-                             fields.at(1).end());
-          fields.at(1).erase(remove(fields.at(1).begin(),
-                                    fields.at(1).end(),
-                                    ','),
-                             fields.at(1).end());
-          fields.at(1).erase(remove(fields.at(1).begin(),
-                                    fields.at(1).end(),
-                                    '\t'),
-                             fields.at(1).end());
-          fields.at(1).erase(remove(fields.at(1).begin(),
-                                    fields.at(1).end(),
-                                    '\n'),
-                             fields.at(1).end());
-
-          // remove comma from nav
-          fields.at(2).erase(remove(fields.at(2).begin(),
-                                    fields.at(2).end(),
-                                    ','),
-                             fields.at(2).end());
+          out << fund.mCode << "," << fund.mName << ",";
+          fund.FormatRow(out, (date - fund.FirstDate()).days());
+          out << "\n";
+        }
+        return out.str();
+      }
+      else if (args.at(0) == "TOPK" && args.size() >= 3 && args.size() <= 4)
+      {
+        FundColumns::COLUMN column;
+        if (!FundColumns::ParseColumn(args.at(1), column))
+        {
+          return "ERROR unknown column\n";
+        }
+        size_t k = stoul(args.at(2));
+        boost::gregorian::date date = args.size() == 4 ?
+          boost::gregorian::from_simple_string(args.at(3)) : last_date;
 
-          if (fields.at(0).find_first_not_of("0123456789") !=
-              std::string::npos)
+        vector<pair<double, const FundColumns*>> values;
+        for (auto& fundKv : funds)
+        {
+          double value = fundKv.second->Get(column, date);
+          if (!std::isnan(value))
           {
-            throw exception();
+            values.push_back(make_pair(value, fundKv.second.get()));
           }
+        }
 
-          if (fields.at(2).find_first_not_of("0123456789.") !=
-              std::string::npos)
-          {
-            throw exception();
-          }
+        k = min(k, values.size());
+        partial_sort(values.begin(), values.begin() + k, values.end(),
+                     [](const pair<double, const FundColumns*>& a,
+                        const pair<double, const FundColumns*>& b)
+                     {
+                       return a.first > b.first;
+                     });
 
-          code = stol(fields.at(0));
-          name = fields.at(1);
-          nav_value = stod(fields.at(2));
+        out << "OK\n";
+        for (size_t i = 0; i < k; ++i)
+        {
+          out << values[i].second->mCode << ","
+              << values[i].second->mName << ","
+              << values[i].first << "\n";
+        }
+        return out.str();
+      }
+      else if (args.at(0) == "INFO" && args.size() == 1)
+      {
+        out << "OK\n"
+            << "funds," << funds.size() << "\n"
+            << "last_date," << to_iso_extended_string(last_date) << "\n";
+        return out.str();
+      }
+    }
+    catch (const exception& e)
+    {
+      return "ERROR invalid request\n";
+    }
+
+    return "ERROR unknown request\n";
+  }
 
-          vector<string> dates = Split(fields.at(5), "-");
+private:
+  void ReadFile(const string& fileName, set<long>& codes)
+  {
+    stringstream raw_mf_data = ReadAllNavFiles(vector<string>(1, fileName),
+                                               *mpIo);
+
+    mFileFunds.erase(fileName);
+    FileFunds& file_funds = mFileFunds[fileName];
+    file_funds.mFunds = ReadMFData(raw_mf_data, 0, numeric_limits<long>::max(),
+                                   *file_funds.mpArena);
+
+    for (auto& mfKv : file_funds.mFunds)
+    {
+      codes.insert(mfKv.first);
+    }
+  }
+
+  void Rebuild(const set<long>& codes)
+  {
+    const size_t MF_BATCH_SIZE = 5000;
 
-          if (dates.size() != 3)
+    vector<long> code_list(codes.begin(), codes.end());
+    for (size_t begin = 0; begin < code_list.size(); begin += MF_BATCH_SIZE)
+    {
+      const size_t end = min(begin + MF_BATCH_SIZE, code_list.size());
+
+      // merge the fund's NAVs from every file, the name is taken from the
+      // file with the latest NAV
+      Arena arena;
+      map<long, MutualFund> mutual_funds;
+      map<long, boost::gregorian::date> name_dates;
+      for (auto& fileKv : mFileFunds)
+      {
+        for (size_t i = begin; i < end; ++i)
+        {
+          auto it = fileKv.second.mFunds.find(code_list[i]);
+          if (it == fileKv.second.mFunds.end())
           {
-            throw exception();
+            continue;
           }
 
-          if (dates.at(0).find_first_not_of("0123456789") !=
-              std::string::npos)
+          const MutualFund& mf = it->second;
+          auto mf_it = mutual_funds.find(mf.mCode);
+          if (mf_it == mutual_funds.end())
           {
-            throw exception();
+            mf_it = mutual_funds.insert(
+                make_pair(mf.mCode, MutualFund(mf.mCode, *mf.mName, arena)))
+                .first;
+            mf_it->second.mCategory = arena.Intern(*mf.mCategory);
+            mf_it->second.mAmc = arena.Intern(*mf.mAmc);
+            name_dates[mf.mCode] = mf.mNavs.rbegin()->first;
           }
 
-          if (dates.at(2).find_first_not_of("0123456789") !=
-              std::string::npos)
+          mf_it->second.mNavs.insert(mf.mNavs.begin(), mf.mNavs.end());
+          if (mf.mNavs.rbegin()->first > name_dates[mf.mCode])
           {
-            throw exception();
+            mf_it->second.mName = arena.Intern(*mf.mName);
+            mf_it->second.mCategory = arena.Intern(*mf.mCategory);
+            mf_it->second.mAmc = arena.Intern(*mf.mAmc);
+            name_dates[mf.mCode] = mf.mNavs.rbegin()->first;
           }
+        }
+      }
+
+      AddMissingDates(mutual_funds, mCompact);
+      CalculateStatistics(mutual_funds, mCompact);
+
+      // copy on write, queries in flight keep using the previous map
+      shared_ptr<FundMap> funds = make_shared<FundMap>(*mpFunds);
+      for (size_t i = begin; i < end; ++i)
+      {
+        auto it = mutual_funds.find(code_list[i]);
+        if (it == mutual_funds.end())
+        {
+          funds->erase(code_list[i]);
+        }
+        else
+        {
+          (*funds)[code_list[i]] =
+            make_shared<FundColumns>(move(it->second), mCompact);
+        }
+      }
+
+      boost::gregorian::date last_date(boost::gregorian::not_a_date_time);
+      for (auto& fundKv : *funds)
+      {
+        if (last_date.is_not_a_date() ||
+            fundKv.second->LastDate() > last_date)
+        {
+          last_date = fundKv.second->LastDate();
+        }
+      }
+
+      lock_guard<mutex> lock(mMutex);
+      mpFunds = funds;
+      mLastDate = last_date;
+    }
+
+    cout << "Holding " << mpFunds->size() << " mutual funds in memory"
+         << endl;
+  }
+
+private:
+  class FileFunds
+  {
+  public:
+    FileFunds()
+      : mpArena(new Arena())
+    {
+    }
+
+  public:
+    unique_ptr<Arena> mpArena;
+    map<long, MutualFund> mFunds;
+  };
+
+  string mNavDir;
+  bool mCompact;
+
+  // only used by the loading thread
+  unique_ptr<FileIo> mpIo;
+  map<string, FileFunds> mFileFunds;
+
+  mutable mutex mMutex;
+  shared_ptr<const FundMap> mpFunds;
+  boost::gregorian::date mLastDate;
+};
+
+volatile sig_atomic_t gStopDaemon = 0;
+
+void
+StopDaemon(int)
+{
+  gStopDaemon = 1;
+}
+
+void
+WatchNavDir(const string& navDir, NavStore& store)
+{
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0 ||
+      inotify_add_watch(fd, navDir.c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO |
+                        IN_DELETE | IN_MOVED_FROM) < 0)
+  {
+    cout << "Could not watch " << navDir << ": " << strerror(errno) << endl;
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return;
+  }
+
+  cout << "Watching " << navDir << " for NAV file changes" << endl;
+
+  alignas(inotify_event) char buffer[64 * 1024];
+  while (!gStopDaemon)
+  {
+    pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 500) <= 0)
+    {
+      continue;
+    }
+
+    // a file written in several steps produces several events, so only
+    // reload each changed file once per read
+    set<string> changed;
+    ssize_t len;
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+      for (char* p = buffer; p < buffer + len; )
+      {
+        inotify_event* event = reinterpret_cast<inotify_event*>(p);
+        if (event->len > 0 && event->name[0] != '.')
+        {
+          changed.insert(navDir + "/" + event->name);
+        }
+        p += sizeof(inotify_event) + event->len;
+      }
+    }
+
+    for (auto& file_name : changed)
+    {
+      store.ReloadFile(file_name);
+    }
+  }
+
+  close(fd);
+}
+
+void
+ServeClient(int fd, const NavStore& store)
+{
+  timeval timeout = { 1, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  string request;
+  char buffer[256];
+  ssize_t len;
+  while (request.find('\n') == string::npos &&
+         request.size() < 4096 &&
+         (len = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+  {
+    request.append(buffer, len);
+  }
+
+  request = request.substr(0, request.find('\n'));
+  request.erase(request.find_last_not_of(" \t\r") + 1);
+
+  string response = store.Query(request);
+
+  for (size_t sent = 0; sent < response.size(); )
+  {
+    ssize_t n = send(fd, response.data() + sent, response.size() - sent,
+                     MSG_NOSIGNAL);
+    if (n <= 0)
+    {
+      break;
+    }
+    sent += n;
+  }
+}
+
+int
+RunDaemon(const string& navDir, const Options& options)
+{
+  // Requests are a single line, the response is "OK\n" followed by the
+  // result, or "ERROR <reason>\n", after which the connection is closed
+  //   SERIES <code>                     the fund's csv content
+  //   SNAPSHOT [YYYY-MM-DD]             code,name,csv row of every fund
+  //   TOPK <column> <k> [YYYY-MM-DD]    code,name,value highest first
+  //   INFO                              number of funds and last date
+
+  NavStore store(navDir, options.mUseUring, options.mCompactColumns);
+  store.LoadAll();
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, options.mSocketPath.c_str(),
+          sizeof(addr.sun_path) - 1);
+
+  unlink(options.mSocketPath.c_str());
+  if (listen_fd < 0 ||
+      bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(listen_fd, 64) < 0)
+  {
+    cout << "Could not listen on " << options.mSocketPath << ": "
+         << strerror(errno) << endl;
+    return 1;
+  }
 
-          // yyyy, mmm, dd
-          nav_date = boost::gregorian::date(
-              stoi(dates.at(2)),
-              boost::date_time::month_str_to_ushort<
-                  boost::gregorian::greg_month>(dates[1]),
-              stoi(dates.at(0)));
+  signal(SIGINT, StopDaemon);
+  signal(SIGTERM, StopDaemon);
 
-          // silently fail
-          if (nav_value == 0)
-          {
-            continue;
-          }
-        }
-        catch (const exception& e)
-        {
-          //cout << "Dropping: " << line << endl;
-          continue;
-        }
+  thread watcher(WatchNavDir, navDir, ref(store));
 
-        if (code < startingMfCode || code > endingMfCode)
-        {
-          continue;
-        }
+  // accepted connections are served by a pool of workers, so that a slow
+  // or idle client only holds up the worker serving it
+  mutex clients_mutex;
+  condition_variable clients_ready;
+  deque<int> clients;
 
-        if (mutual_funds.find(code) == mutual_funds.end())
+  auto worker = [&]()
+  {
+    while (true)
+    {
+      int fd;
+      {
+        unique_lock<mutex> lock(clients_mutex);
+        clients_ready.wait(lock, [&]()
         {
-          MutualFundData mf_data(nav_value);
-          MutualFund mf(code, name, nav_date, mf_data);
-          mutual_funds.insert(make_pair(code, mf));
-        }
-        else
+          return gStopDaemon || !clients.empty();
+        });
+        if (clients.empty())
         {
-          mutual_funds.at(code).mName = name;
-          MutualFundData mf_data(nav_value);
-          mutual_funds.at(code).mData.insert(
-              make_pair(nav_date, mf_data));
+          return;
         }
-
-        num_nav++;
+        fd = clients.front();
+        clients.pop_front();
       }
+
+      ServeClient(fd, store);
+      close(fd);
     }
+  };
+
+  vector<thread> workers;
+  for (unsigned t = 0; t < options.mNumThreads; ++t)
+  {
+    workers.push_back(thread(worker));
   }
 
-  cout << "Read " << mutual_funds.size() << " mutual funds and "
-       << num_nav << " NAVs" << endl;
+  cout << "Serving queries on " << options.mSocketPath << " with "
+       << workers.size() << " workers" << endl;
 
-  return mutual_funds;
+  while (!gStopDaemon)
+  {
+    pollfd pfd = { listen_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 500) <= 0)
+    {
+      continue;
+    }
+
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+      continue;
+    }
+
+    {
+      lock_guard<mutex> lock(clients_mutex);
+      clients.push_back(fd);
+    }
+    clients_ready.notify_one();
+  }
+
+  // gStopDaemon is set without the lock, taking it makes sure no worker is
+  // between checking it and waiting when they are woken up
+  {
+    lock_guard<mutex> lock(clients_mutex);
+  }
+  clients_ready.notify_all();
+  for (auto& t : workers)
+  {
+    t.join();
+  }
+
+  watcher.join();
+  close(listen_fd);
+  unlink(options.mSocketPath.c_str());
+
+  cout << "Stopped daemon" << endl;
+  return 0;
 }
 
 void
-AddMissingDates(map<long, MutualFund>& mutualFunds)
+RunIoBenchmark(const string& navDir, const string& csvDir)
 {
-  cout << "Cleaning " << mutualFunds.size() << " mutual funds" << endl;
+  // the two I/O patterns of a run: a few hundred large sequential NAV file
+  // reads, and an open/write/close per fund csv file, here rewriting the
+  // csv files of the previous run into a scratch directory
+  vector<string> nav_files = GetNavFileNames(navDir);
 
-  int added_navs = 0;
-  int i = 0;
+  vector<string> csv_files;
+  for (auto& file_name : GetNavFileNames(csvDir))
+  {
+    string base = file_name.substr(csvDir.size() + 1);
+    if (base.size() > 4 &&
+        base.compare(base.size() - 4, 4, ".csv") == 0 &&
+        base.find_first_not_of("0123456789") == base.size() - 4)
+    {
+      csv_files.push_back(file_name);
+    }
+  }
 
-  for (auto& mfKv : mutualFunds)
+  vector<string> csv_contents;
+  PosixIo().ReadFiles(csv_files, csv_contents);
+
+  const string scratch_dir = csvDir + "/io_benchmark";
+  mkdir(scratch_dir.c_str(), 0755);
+
+  vector<string> reference;
+  for (bool use_uring : { false, true })
   {
-    ++i;
-    if (i % 1000 == 0)
+    vector<string> contents;
+    unique_ptr<FileIo> read_io = CreateFileIo(use_uring);
+    read_io->ReadFiles(nav_files, contents);
+
+    size_t bytes = 0;
+    for (auto& content : contents)
     {
-      cout << "[" << (i + 1) << "/" << mutualFunds.size() << "]"
-           << " Cleaning..." << endl;
+      bytes += content.size();
     }
+    read_io->PrintStats("Read " + to_string(nav_files.size()) +
+                        " NAV files (" + to_string(bytes >> 20) +
+                        " MB) with ");
 
-    double last_valid_nav =
-      *mfKv.second.mData.begin()->second.Get(MutualFundData::TYPE::NAV);
+    if (reference.empty())
+    {
+      reference.swap(contents);
+    }
+    else if (contents != reference)
+    {
+      cout << "NAV files read by " << read_io->Name()
+           << " differ from those read by POSIX I/O" << endl;
+    }
 
-    for (boost::gregorian::date d = mfKv.second.mData.begin()->first;
-         d <= mfKv.second.mData.rbegin()->first;
-         d += boost::gregorian::date_duration(1))
+    unique_ptr<FileIo> write_io = CreateFileIo(use_uring);
+    bytes = 0;
+    for (size_t i = 0; i < csv_files.size(); ++i)
     {
-      if (mfKv.second.mData.find(d) == mfKv.second.mData.end())
-      {
-        // for missing date, use the last read nav
-        mfKv.second.mData.insert(make_pair(d, MutualFundData(last_valid_nav)));
-        added_navs++;
-      }
-      else
-      {
-        last_valid_nav =
-          *mfKv.second.mData.at(d).Get(MutualFundData::TYPE::NAV);
-      }
+      write_io->WriteFile(
+          scratch_dir + csv_files[i].substr(csvDir.size()), csv_contents[i]);
+      bytes += csv_contents[i].size();
+    }
+    write_io->Flush();
+    write_io->PrintStats("Wrote " + to_string(csv_files.size()) +
+                         " csv files (" + to_string(bytes >> 20) +
+                         " MB) with ");
+
+    // both backends create the files rather than truncate existing ones
+    for (auto& file_name : GetNavFileNames(scratch_dir))
+    {
+      unlink(file_name.c_str());
     }
   }
 
-  cout << "Cleaned " << mutualFunds.size() << " mutual funds"
-       << " and added " << added_navs << " NAVs" << endl;
+  rmdir(scratch_dir.c_str());
 }
 
-tuple<bool, double>
-CalculateCagr(const map<boost::gregorian::date, MutualFundData>& mfData,
-              const boost::gregorian::date& presentDate,
-              MutualFundData::TYPE type,
-              int daysAgo)
+void
+WriteCrossFundOutputs(
+    const string& csvDir,
+    const Options& options,
+    const vector<shared_ptr<const FundColumns>>& allFunds,
+    const map<long, vector<pair<boost::gregorian::date, double>>>&
+      dailyReturns)
 {
-  boost::gregorian::date old_date = presentDate -
-    boost::gregorian::date_duration(daysAgo);
+  if (options.mCategoryStats)
+  {
+    CategoryStatistics category_statistics(allFunds);
+    category_statistics.Write(csvDir, options.mNumThreads);
+  }
 
-  if (mfData.find(old_date) != mfData.end())
+  if (options.mBacktest)
   {
-    const double* old_val = mfData.at(old_date).Get(type);
-    if (old_val == nullptr)
+    vector<Backtest::Variant> variants;
+    for (auto& rank : options.mBacktestRanks)
     {
-      return make_tuple(false, 0);
+      for (auto& risk : options.mBacktestRisks)
+      {
+        for (int holdings : options.mBacktestHoldings)
+        {
+          for (int months : options.mBacktestMonths)
+          {
+            Backtest::Variant variant;
+            FundColumns::ParseColumn(rank, variant.mRank);
+            variant.mHasRisk = FundColumns::ParseColumn(risk, variant.mRisk);
+            variant.mHoldings = holdings;
+            variant.mRebalanceMonths = months;
+            variants.push_back(variant);
+          }
+        }
+      }
     }
 
-    const double* present_val = mfData.at(presentDate).Get(type);
+    Backtest backtest(allFunds, variants);
+    backtest.Run(csvDir, options.mNumThreads);
+  }
 
-    double cagr = (pow((*present_val / *old_val), 365.0f/daysAgo) - 1) * 100.0f;
-    return make_tuple(true, cagr);
+  if (options.mCorrEnabled)
+  {
+    ReturnMatrix matrix = BuildReturnMatrix(dailyReturns);
+    vector<double> corr = CalculateCorrelation(matrix, options.mNumThreads);
+    WriteCorrelation(csvDir, matrix, corr, options.mCorrBinary);
   }
 
-  return make_tuple(false, 0);
 }
 
-tuple<bool, double>
-CalculateAverage(
-    const map<boost::gregorian::date, MutualFundData>& mfData,
-    const boost::gregorian::date& presentDate,
-    MutualFundData::TYPE type,
-    double& rollingTotal,
-    int windowDays)
+void
+WriteDailyReturns(
+    const string& directory,
+    const map<long, vector<pair<boost::gregorian::date, double>>>&
+      dailyReturns)
 {
-  if (mfData.at(presentDate).Get(type) != nullptr)
+  // code,date,return at full precision, for the correlation of a merge,
+  // and just the code for a fund without returns
+  string file_name = directory + "/daily_returns.csv";
+  ofstream out(file_name.c_str());
+  out << setprecision(17);
+  for (auto& returnsKv : dailyReturns)
   {
-    const double current_value = *mfData.at(presentDate).Get(type);
-
-    rollingTotal += current_value;
-
-    boost::gregorian::date first_date = presentDate -
-      boost::gregorian::date_duration(windowDays - 1);
+    if (returnsKv.second.empty())
+    {
+      out << returnsKv.first << "\n";
+    }
+    for (auto& dayReturn : returnsKv.second)
+    {
+      out << returnsKv.first << ","
+          << to_iso_extended_string(dayReturn.first) << ","
+          << dayReturn.second << "\n";
+    }
+  }
+  out.close();
+}
 
-    if (mfData.find(first_date) != mfData.end())
+bool
+ReadDailyReturns(
+    const string& directory,
+    map<long, vector<pair<boost::gregorian::date, double>>>& dailyReturns)
+{
+  string file_name = directory + "/daily_returns.csv";
+  ifstream in(file_name.c_str());
+  string line;
+  vector<string> fields;
+  while (getline(in, line))
+  {
+    try
     {
-      const double* first_value = mfData.at(first_date).Get(type);
-      if (first_value == nullptr)
+      size_t num_fields = SplitInto(line, ',', fields);
+      long code;
+      if (!ParseCode(fields[0], code) || (num_fields != 1 && num_fields != 3))
       {
-        return make_tuple(false, 0);
+        throw invalid_argument(line);
       }
 
-      double current_average = rollingTotal / windowDays;
+      vector<pair<boost::gregorian::date, double>>& returns =
+        dailyReturns[code];
+      if (num_fields == 3)
+      {
+        returns.push_back(
+            make_pair(boost::gregorian::from_simple_string(fields[1]),
+                      stod(fields[2])));
+      }
+    }
+    catch (const exception& e)
+    {
+      cout << "Malformed line in " << file_name << ": " << line << endl;
+      return false;
+    }
+  }
+  return true;
+}
 
-      rollingTotal -= *first_value;
+bool
+ReadPack(const string& fileName, vector<pair<long, string>>& entries)
+{
+  // see PackWriter for the layout
+  const size_t TRAILER_SIZE = 30;
+
+  ifstream in(fileName.c_str(), ios::binary);
+  stringstream pack;
+  pack << in.rdbuf();
+  const string data = pack.str();
+  if (data.size() < TRAILER_SIZE ||
+      data.compare(data.size() - TRAILER_SIZE, 9, "MFPACK01,") != 0)
+  {
+    return false;
+  }
 
-      return make_tuple(true, current_average);
+  try
+  {
+    const size_t index_offset =
+      stoull(data.substr(data.size() - TRAILER_SIZE + 9, 20));
+    istringstream index(data.substr(
+          index_offset, data.size() - TRAILER_SIZE - index_offset));
+    string line;
+    vector<string> fields;
+    while (getline(index, line))
+    {
+      long code;
+      if (SplitInto(line, ',', fields) != 3 || !ParseCode(fields[0], code))
+      {
+        return false;
+      }
+      entries.push_back(make_pair(code,
+                                  data.substr(stoull(fields[1]),
+                                              stoull(fields[2]))));
     }
   }
-
-  return make_tuple(false, 0);
+  catch (const exception& e)
+  {
+    return false;
+  }
+  return true;
 }
 
-tuple<bool, double, double>
-CalculateAverageAndVarianceSum(
-    const map<boost::gregorian::date, MutualFundData>& mfData,
-    const boost::gregorian::date& presentDate,
-    MutualFundData::TYPE type,
-    double& rollingTotal,
-    double& prevVarSum,
-    double& prevAverage,
-    int windowDays)
+int
+MergeShards(const string& csvDir, const string& navDir, const Options& options)
 {
-  if (mfData.at(presentDate).Get(type) != nullptr)
+  // every shard wrote its funds' csv files to csvDir and its share of the
+  // lookups, packs, SIP XIRRs, daily returns and fund columns to its shard
+  // directory, along with the manifest of what they were made from
+  const unsigned num_shards = options.mMergeShards;
+  cout << "Merging " << num_shards << " shards" << endl;
+
+  const vector<string> nav_files = GetNavFileNames(navDir);
+  stringstream mf_code_lookup;
+  stringstream mf_category_lookup;
+  stringstream sip_xirr;
+  map<long, vector<pair<boost::gregorian::date, double>>> daily_returns;
+  vector<string> shard_dirs;
+
+  for (unsigned shard = 0; shard < num_shards; ++shard)
   {
-    const double current_value = *mfData.at(presentDate).Get(type);
+    shard_dirs.push_back(ShardDirectory(csvDir, shard, num_shards));
 
-    rollingTotal += current_value;
+    ifstream manifest_in((shard_dirs.back() + "/manifest.csv").c_str());
+    if (!manifest_in.is_open())
+    {
+      cout << "Shard " << shard << " of " << num_shards
+           << " has not been run to completion" << endl;
+      return 1;
+    }
+    stringstream manifest;
+    manifest << manifest_in.rdbuf();
+    if (manifest.str() != ShardManifest(nav_files, shard, options))
+    {
+      cout << "Shard " << shard << " of " << num_shards
+           << " was run on other NAV files or with other options" << endl;
+      return 1;
+    }
 
-    boost::gregorian::date first_date = presentDate -
-      boost::gregorian::date_duration(windowDays - 1);
+    // code,name and code,category,amc
+    for (auto lookup : { make_pair("/mf_code_names.csv", &mf_code_lookup),
+                         make_pair("/mf_code_categories.csv",
+                                   &mf_category_lookup) })
+    {
+      const string file_name = shard_dirs.back() + lookup.first;
+      ifstream in(file_name.c_str());
+      string line;
+      long code;
+      while (getline(in, line))
+      {
+        if (!ParseCode(line.substr(0, line.find(',')), code) ||
+            line.find(',') == string::npos)
+        {
+          cout << "Malformed line in " << file_name << ": " << line << endl;
+          return 1;
+        }
+        *lookup.second << line << "\n";
+      }
+    }
 
-    if (mfData.find(first_date) != mfData.end())
+    if (options.mSipXirr)
     {
-      const double* first_value = mfData.at(first_date).Get(type);
-      if (first_value == nullptr)
+      ifstream in((shard_dirs.back() + "/sip_xirr.csv").c_str());
+      string line;
+      getline(in, line);
+      while (getline(in, line))
       {
-        return make_tuple(false, 0, 0);
+        sip_xirr << line << "\n";
       }
+    }
 
-      double current_average = rollingTotal / windowDays;
+    if (options.mCorrEnabled &&
+        !ReadDailyReturns(shard_dirs.back(), daily_returns))
+    {
+      return 1;
+    }
+  }
 
-      rollingTotal -= *first_value;
+  if (options.mWritePack)
+  {
+    vector<string> extensions(1, "");
+    if (options.mGzip)
+    {
+      extensions.push_back(".gz");
+    }
+    if (options.mBrotli)
+    {
+      extensions.push_back(".br");
+    }
 
-      // first run
-      double var_sum;
-      if (prevVarSum == 0)
+    for (auto& extension : extensions)
+    {
+      PackWriter pack_writer(csvDir + "/navs.pack" + extension);
+      for (auto& shard_dir : shard_dirs)
       {
-        double squared_diff_total = 0;
-        boost::gregorian::date temp_date;
-        for (temp_date = first_date;
-             temp_date <= presentDate;
-             temp_date += boost::gregorian::date_duration(1))
+        vector<pair<long, string>> entries;
+        if (!ReadPack(shard_dir + "/navs.pack" + extension, entries))
         {
-          const double value = *mfData.at(temp_date).Get(type);
-          squared_diff_total += pow(value - current_average, 2);
+          cout << "Could not read " << shard_dir << "/navs.pack" << extension
+               << endl;
+          return 1;
+        }
+
+        for (auto& entry : entries)
+        {
+          pack_writer.Add(entry.first, entry.second);
         }
-        var_sum = squared_diff_total;
       }
-      else
+      if (!pack_writer.Close())
       {
-        const double out_of_window_value = *mfData.at(
-            first_date - boost::gregorian::date_duration(1)).Get(type);
-
-        var_sum = prevVarSum +
-          ((current_value - out_of_window_value) *
-          (current_value - current_average + out_of_window_value - prevAverage));
+        return 1;
       }
-
-      prevAverage = current_average;
-      prevVarSum = var_sum;
-
-      return make_tuple(true, var_sum, current_average);
     }
   }
+  else
+  {
+    RemovePacks(csvDir);
+  }
 
-  return make_tuple(false, 0, 0);
-}
-
-void
-CalculateStatistics(map<long, MutualFund>& mutualFunds)
-{
-  // cagr = ((final_value / initial_value)^(1 / number of periods) - 1) x 100
-  // std_dev = ((sum of [(actual - mean)^2]) / N)^(1/2)
-  // std_dev = sqrt(var_sum/size)
-  // http://jonisalonen.com/2014/efficient-and-accurate-rolling-standard-deviation/
-  // variance_sum = prev_variance_sum +
-  //   (newest_val - oldest_val_just_outside_window) *
-  //   (newest_val - new_avg + oldest_val_just_outside_window - prev_avg)
+  WriteMfCodeLookupToCsv(csvDir, mf_code_lookup, mf_category_lookup);
 
-  cout << "Calculating statistics for " << mutualFunds.size()
-       << " mutual funds" << endl;
+  if (options.mSipXirr)
+  {
+    WriteSipXirr(csvDir, options.mSipWindowMonths, sip_xirr);
+  }
 
-  int i = 0;
-  for (auto& mfKv : mutualFunds)
+  // the funds' columns as written, in the order of the lookups
+  vector<shared_ptr<const FundColumns>> all_funds;
+  if (options.mCategoryStats || options.mBacktest)
   {
-    ++i;
-    if (i % 1000 == 0)
+    cout << "Reading columns of the merged mutual funds" << endl;
+
+    for (auto& shard_dir : shard_dirs)
     {
-      cout << "[" << (i + 1) << "/" << mutualFunds.size() << "]"
-           << " Calculating..." << endl;
+      const string file_name = shard_dir + "/columns.bin";
+      ifstream in(file_name.c_str(), ios::binary);
+      try
+      {
+        while (in.peek() != ifstream::traits_type::eof())
+        {
+          all_funds.push_back(
+              make_shared<FundColumns>(in, options.mCompactColumns));
+        }
+      }
+      catch (const exception& e)
+      {
+        cout << "Could not read " << file_name << ": " << e.what() << endl;
+        return 1;
+      }
     }
 
-    double one_yr_nav_rolling_total = 0;
+    cout << "Read columns of " << all_funds.size() << " mutual funds"
+         << endl;
+  }
 
-    double two_yr_rolling_total_for_one_yr_nav_cagr = 0;
-    double prev_two_yr_var_sum_for_one_yr_nav_cagr = 0;
-    double prev_two_yr_avg_for_one_yr_nav_cagr = 0;
+  WriteCrossFundOutputs(csvDir, options, all_funds, daily_returns);
 
-    double four_yr_rolling_total_for_one_yr_nav_cagr = 0;
-    double prev_four_yr_var_sum_for_one_yr_nav_cagr = 0;
-    double prev_four_yr_avg_for_one_yr_nav_cagr = 0;
+  cout << "Merged " << num_shards << " shards" << endl;
+  return 0;
+}
+
+long
+GetCurrentTimeSecs()
+{
+  struct timeval tp;
+  gettimeofday(&tp, NULL);
+  long secs = tp.tv_sec + tp.tv_usec / 1000000;
+  return secs;
+}
+
+void
+PrintUsage(const char* program)
+{
+  cout << "Usage: " << program << " [options]" << endl
+       << "  --threads N              worker threads"
+       << " (default: hardware concurrency)" << endl
+       << "  --corr-all               correlate daily returns of all funds"
+       << endl
+       << "  --corr-codes C1,C2,...   correlate daily returns of these funds"
+       << endl
+       << "  --corr-category SLUG     correlate daily returns of a category's"
+       << " funds, see categories.csv" << endl
+       << "  --corr-from YYYY-MM-DD   first date of the correlation window"
+       << endl
+       << "  --corr-to YYYY-MM-DD     last date of the correlation window"
+       << endl
+       << "  --corr-format csv|bin    correlation output format"
+       << " (default: csv)" << endl
+       << "  --output csv|pack|both   write per fund csv files, a single"
+       << " indexed navs.pack, or both (default: csv)" << endl
+       << "  --gzip                   also write gzip compressed output"
+       << endl
+       << "  --brotli                 also write brotli compressed output"
+       << endl
+       << "  --category-stats         write per category aggregates and"
+       << " percentile ranks" << endl
+       << "  --sip-xirr               write rolling SIP XIRR min/median/max"
+       << endl
+       << "  --sip-months M1,M2,...   SIP lengths in months"
+       << " (default: 36,60)" << endl
+       << "  --io-backend posix|uring read NAV files and write csv files with"
+       << " POSIX calls or io_uring (default: posix)" << endl
+       << "  --io-benchmark           compare both I/O backends on the NAV"
+       << " files and existing csv files" << endl
+       << "  --daemon                 keep the data in memory, reload changed"
+       << " NAV files and serve queries" << endl
+       << "  --socket PATH            daemon unix socket"
+       << " (default: downloader.sock)" << endl
+       << "  --stream URL|-           parse NAV reports while fetching the"
+       << " missing months from an http:// report URL such as" << endl
+       << "                           http://portal.amfiindia.com/"
+       << "DownloadNAVHistoryReport_Po.aspx?" << endl
+       << "                           or while reading them from stdin"
+       << endl
+       << "  --stream-jobs N          months fetched concurrently"
+       << " (default: 4)" << endl
+       << "  --stream-from YYYY-MM-DD first month to fetch"
+       << " (default: 2006-04-01)" << endl
+       << "  --stream-to YYYY-MM-DD   last month to fetch"
+       << " (default: end of last month)" << endl
+       << "  --backtest               backtest every combination of the"
+       << " screening rules below" << endl
+       << "  --backtest-rank C1,...   columns to pick funds by"
+       << " (default: 3y_cagr)" << endl
+       << "  --backtest-risk C1,...   columns to then prefer the lower"
+       << " half of, or none (default: none,2y_sd)" << endl
+       << "  --backtest-top N1,...    number of funds held"
+       << " (default: 10)" << endl
+       << "  --backtest-rebalance M1,... months between rebalances, 0 to"
+       << " never rebalance (default: 1,12,0)" << endl
+       << "  --build-index            build the per NAV file code indexes"
+       << " used by --shard" << endl
+       << "  --shard I/N              process only the I-th (from 0) of N"
+       << " slices of the MF codes" << endl
+       << "  --merge N                merge the outputs of N shards run with"
+       << " the same options" << endl
+       << "  --storage double|compact store the NAVs and statistics as"
+       << " doubles or as scaled integers and floats (default: double)"
+       << endl
+       << "  --verify-storage         run with double and with compact"
+       << " storage and compare the files written" << endl;
+}
+
+bool
+ParseOptions(int argc, char* argv[], Options& options)
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg = argv[i];
+    bool has_value = i + 1 < argc;
 
-    for (auto& dataKv : mfKv.second.mData)
+    try
     {
-      // NAV AVG ----------------------------------------------------
+      if (arg == "--threads" && has_value)
+      {
+        options.mNumThreads = max(1, stoi(argv[++i]));
+      }
+      else if (arg == "--corr-all")
+      {
+        options.mCorrEnabled = true;
+        options.mCorrAllFunds = true;
+      }
+      else if (arg == "--corr-codes" && has_value)
+      {
+        options.mCorrEnabled = true;
+        for (auto& code : Split(argv[++i], ","))
+        {
+          options.mCorrCodes.insert(stol(code));
+        }
+      }
+      else if (arg == "--corr-category" && has_value)
+      {
+        options.mCorrEnabled = true;
+        options.mCorrCategory = ToSlug(argv[++i]);
+      }
+      else if (arg == "--corr-from" && has_value)
+      {
+        options.mCorrFrom = boost::gregorian::from_simple_string(argv[++i]);
+      }
+      else if (arg == "--corr-to" && has_value)
+      {
+        options.mCorrTo = boost::gregorian::from_simple_string(argv[++i]);
+      }
+      else if (arg == "--corr-format" && has_value)
+      {
+        string format = argv[++i];
+        if (format != "csv" && format != "bin")
+        {
+          throw exception();
+        }
+        options.mCorrBinary = format == "bin";
+      }
+      else if (arg == "--gzip")
+      {
+        options.mGzip = true;
+      }
+      else if (arg == "--brotli")
+      {
+        options.mBrotli = true;
+      }
+      else if (arg == "--category-stats")
       {
-        auto res = CalculateAverage(mfKv.second.mData, dataKv.first,
-                                    MutualFundData::TYPE::NAV,
-                                    one_yr_nav_rolling_total,
-                                    30);
-        if (get<0>(res))
+        options.mCategoryStats = true;
+      }
+      else if (arg == "--sip-xirr")
+      {
+        options.mSipXirr = true;
+      }
+      else if (arg == "--sip-months" && has_value)
+      {
+        options.mSipWindowMonths.clear();
+        for (auto& months : Split(argv[++i], ","))
         {
-          mfKv.second.mData.at(
-            dataKv.first - boost::gregorian::date_duration(15)).Set(
-              MutualFundData::TYPE::ONE_MNTH_NAV_AVG, get<1>(res));
+          options.mSipWindowMonths.push_back(stoi(months));
+          if (options.mSipWindowMonths.back() < 1)
+          {
+            throw exception();
+          }
         }
       }
-
-      // NAV CAGR ---------------------------------------------------
+      else if (arg == "--io-backend" && has_value)
       {
-        auto res = CalculateCagr(mfKv.second.mData, dataKv.first,
-                                 MutualFundData::TYPE::NAV, 365);
-        if (get<0>(res))
+        string backend = argv[++i];
+        if (backend != "posix" && backend != "uring")
         {
-          dataKv.second.Set(MutualFundData::TYPE::ONE_YR_NAV_CAGR,
-                            get<1>(res));
+          throw exception();
         }
+        options.mUseUring = backend == "uring";
       }
+      else if (arg == "--io-benchmark")
       {
-        auto res = CalculateCagr(mfKv.second.mData, dataKv.first,
-                                 MutualFundData::TYPE::NAV, 1095);
-        if (get<0>(res))
+        options.mIoBenchmark = true;
+      }
+      else if (arg == "--daemon")
+      {
+        options.mDaemon = true;
+      }
+      else if (arg == "--socket" && has_value)
+      {
+        options.mSocketPath = argv[++i];
+      }
+      else if (arg == "--stream" && has_value)
+      {
+        options.mStreamSource = argv[++i];
+      }
+      else if (arg == "--stream-jobs" && has_value)
+      {
+        options.mStreamJobs = max(1, stoi(argv[++i]));
+      }
+      else if (arg == "--stream-from" && has_value)
+      {
+        options.mStreamFrom = boost::gregorian::from_simple_string(argv[++i]);
+      }
+      else if (arg == "--stream-to" && has_value)
+      {
+        options.mStreamTo = boost::gregorian::from_simple_string(argv[++i]);
+      }
+      else if (arg == "--backtest")
+      {
+        options.mBacktest = true;
+      }
+      else if (arg == "--build-index")
+      {
+        options.mBuildIndex = true;
+      }
+      else if (arg == "--shard" && has_value)
+      {
+        vector<string> shard = Split(argv[++i], "/");
+        if (shard.size() != 2)
+        {
+          throw exception();
+        }
+        options.mShard = stoul(shard[0]);
+        options.mNumShards = stoul(shard[1]);
+        if (options.mNumShards < 1 || options.mShard >= options.mNumShards)
         {
-          dataKv.second.Set(MutualFundData::TYPE::THREE_YR_NAV_CAGR,
-                            get<1>(res));
+          throw exception();
         }
       }
+      else if (arg == "--merge" && has_value)
       {
-        auto res = CalculateCagr(mfKv.second.mData, dataKv.first,
-                                 MutualFundData::TYPE::NAV, 1825);
-        if (get<0>(res))
+        options.mMergeShards = stoul(argv[++i]);
+        if (options.mMergeShards < 1)
         {
-          dataKv.second.Set(MutualFundData::TYPE::FIVE_YR_NAV_CAGR,
-                            get<1>(res));
+          throw exception();
         }
       }
-
-      // DEVIATION OF 1 YR CAGR -------------------------------------
+      else if ((arg == "--backtest-rank" || arg == "--backtest-risk") &&
+               has_value)
       {
-        auto res = CalculateAverageAndVarianceSum(
-            mfKv.second.mData, dataKv.first,
-            MutualFundData::TYPE::ONE_YR_NAV_CAGR,
-            two_yr_rolling_total_for_one_yr_nav_cagr,
-            prev_two_yr_var_sum_for_one_yr_nav_cagr,
-            prev_two_yr_avg_for_one_yr_nav_cagr,
-            730);
-
-        if (get<0>(res))
+        vector<string> columns = Split(argv[++i], ",");
+        for (auto& name : columns)
         {
-          dataKv.second.Set(
-              MutualFundData::TYPE::TWO_YR_VARIANCE_SUM_FOR_ONE_YR_NAV_CAGR,
-              get<1>(res));
+          FundColumns::COLUMN column;
+          if (!(arg == "--backtest-risk" && name == "none") &&
+              !FundColumns::ParseColumn(name, column))
+          {
+            throw exception();
+          }
         }
+        (arg == "--backtest-rank" ?
+         options.mBacktestRanks : options.mBacktestRisks) = columns;
       }
+      else if (arg == "--backtest-top" && has_value)
       {
-        auto res = CalculateAverageAndVarianceSum(
-            mfKv.second.mData, dataKv.first,
-            MutualFundData::TYPE::ONE_YR_NAV_CAGR,
-            four_yr_rolling_total_for_one_yr_nav_cagr,
-            prev_four_yr_var_sum_for_one_yr_nav_cagr,
-            prev_four_yr_avg_for_one_yr_nav_cagr,
-            1460);
-
-        if (get<0>(res))
+        options.mBacktestHoldings.clear();
+        for (auto& holdings : Split(argv[++i], ","))
+        {
+          options.mBacktestHoldings.push_back(stoi(holdings));
+          if (options.mBacktestHoldings.back() < 1)
+          {
+            throw exception();
+          }
+        }
+      }
+      else if (arg == "--backtest-rebalance" && has_value)
+      {
+        options.mBacktestMonths.clear();
+        for (auto& months : Split(argv[++i], ","))
+        {
+          options.mBacktestMonths.push_back(stoi(months));
+          if (options.mBacktestMonths.back() < 0)
+          {
+            throw exception();
+          }
+        }
+      }
+      else if (arg == "--storage" && has_value)
+      {
+        string storage = argv[++i];
+        if (storage != "double" && storage != "compact")
+        {
+          throw exception();
+        }
+        options.mCompactColumns = storage == "compact";
+      }
+      else if (arg == "--verify-storage")
+      {
+        options.mVerifyStorage = true;
+      }
+      else if (arg == "--output" && has_value)
+      {
+        string output = argv[++i];
+        if (output != "csv" && output != "pack" && output != "both")
         {
-          dataKv.second.Set(
-              MutualFundData::TYPE::FOUR_YR_VARIANCE_SUM_FOR_ONE_YR_NAV_CAGR,
-              get<1>(res));
+          throw exception();
         }
+        options.mWriteCsvFiles = output != "pack";
+        options.mWritePack = output != "csv";
+      }
+      else
+      {
+        cout << "Unknown or incomplete option: " << arg << endl;
+        return false;
       }
     }
+    catch (const exception& e)
+    {
+      cout << "Invalid value for option: " << arg << endl;
+      return false;
+    }
   }
 
-  cout << "Calculated statistics for " << mutualFunds.size()
-       << " mutual funds" << endl;
+  if (options.mNumShards > 0 && !options.mStreamSource.empty())
+  {
+    cout << "--shard reads the NAV files and cannot be combined with --stream"
+         << endl;
+    return false;
+  }
+
+  return true;
 }
 
-void
-WriteToCsv(map<long, MutualFund>& mutualFunds,
-           const string& directory,
-           stringstream& mfCodeLookup)
+// The default run: reads the NAV files batch by batch of MF codes, or the
+// stream, and writes the csv files and the other outputs.
+int
+RunBatches(const string& navDir,
+           const string& csvDir,
+           const Options& options,
+           long batchSize)
 {
-  cout << "Writing CSVs for " << mutualFunds.size()
-       << " mutual funds" << endl;
-
-  int i = 0;
-  for (auto& mfKv : mutualFunds)
+  // a shard writes the outputs other than the fund csv files to its own
+  // directory for the merge
+  string out_dir = csvDir;
+  string shard_manifest;
+  ofstream shard_columns;
+  if (options.mNumShards > 0)
   {
-    ++i;
-    if (i % 1000 == 0)
+    mkdir((csvDir + "/shards").c_str(), 0755);
+    out_dir = ShardDirectory(csvDir, options.mShard, options.mNumShards);
+    mkdir(out_dir.c_str(), 0755);
+
+    // the manifest is written last, so a merge never takes the outputs of
+    // an incomplete run
+    unlink((out_dir + "/manifest.csv").c_str());
+    shard_manifest = ShardManifest(GetNavFileNames(navDir), options.mShard,
+                                   options);
+    if (options.mCategoryStats || options.mBacktest)
     {
-      cout << "[" << (i + 1) << "/" << mutualFunds.size() << "]"
-           << " Writing..." << endl;
+      shard_columns.open((out_dir + "/columns.bin").c_str(),
+                         ios::binary | ios::trunc);
     }
+  }
 
-    string file_name = directory + "/" + to_string(mfKv.second.mCode) + ".csv";
-    ofstream out(file_name.c_str());
+  unique_ptr<FileIo> io = CreateFileIo(options.mUseUring);
+
+  stringstream mf_code_lookup;
+  stringstream mf_category_lookup;
+  unique_ptr<PackWriter> pack_writer;
+  if (options.mWritePack)
+  {
+    pack_writer.reset(new PackWriter(out_dir + "/navs.pack"));
+  }
+  else if (options.mNumShards == 0)
+  {
+    RemovePacks(csvDir);
+  }
+  unique_ptr<Compressor> compressor;
+  if (options.mGzip || options.mBrotli)
+  {
+    compressor.reset(new Compressor(options, csvDir, out_dir,
+                                    options.mNumThreads));
+  }
+  map<long, vector<pair<boost::gregorian::date, double>>> daily_returns;
+  vector<shared_ptr<const FundColumns>> all_funds;
+  stringstream sip_xirr;
+  size_t max_batch_bytes = 0;
+  size_t all_funds_bytes = 0;
 
-    for (auto& dataKv : mfKv.second.mData)
+  auto process_batch = [&](map<long, MutualFund>& mutual_funds)
+  {
+    CollectDailyReturns(mutual_funds, options, daily_returns);
+    AddMissingDates(mutual_funds, options.mCompactColumns);
+    ReportAllocations("adding missing dates");
+    CalculateStatistics(mutual_funds, options.mCompactColumns);
+    ReportAllocations("calculating statistics");
+
+    size_t batch_bytes = 0;
+    for (auto& mfKv : mutual_funds)
     {
-      out << fixed << setprecision(4)
-          << to_iso_extended_string(dataKv.first) << ","
-          << *dataKv.second.Get(MutualFundData::TYPE::NAV) << ",";
+      batch_bytes += mfKv.second.mData.Bytes();
+    }
+    max_batch_bytes = max(max_batch_bytes, batch_bytes);
 
-      {
-        auto data = dataKv.second.Get(MutualFundData::TYPE::ONE_MNTH_NAV_AVG);
-        if (data != nullptr)
-        {
-          out << *data;
-        }
-      }
+    if (options.mSipXirr)
+    {
+      CalculateSipXirr(mutual_funds, options.mSipWindowMonths,
+                       options.mNumThreads, sip_xirr);
+    }
+    WriteToCsv(mutual_funds, csvDir, options, *io, pack_writer.get(),
+               compressor.get(), mf_code_lookup, mf_category_lookup);
+    ReportAllocations("writing CSVs");
 
-      out << ",";
+    // the funds are not needed after this, so their columns are moved
+    if ((options.mCategoryStats || options.mBacktest) &&
+        options.mNumShards == 0)
+    {
+      for (auto& mfKv : mutual_funds)
       {
-        auto data = dataKv.second.Get(MutualFundData::TYPE::ONE_YR_NAV_CAGR);
-        if (data != nullptr)
-        {
-          out << *data;
-        }
+        all_funds.push_back(make_shared<FundColumns>(
+            move(mfKv.second), options.mCompactColumns));
+        all_funds_bytes += all_funds.back()->Bytes();
       }
-
-      out << ",";
+    }
+    else if (shard_columns.is_open())
+    {
+      // as doubles, so a merge calculates what a single run does
+      for (auto& mfKv : mutual_funds)
       {
-        auto data = dataKv.second.Get(MutualFundData::TYPE::THREE_YR_NAV_CAGR);
-        if (data != nullptr)
-        {
-          out << *data;
-        }
+        FundColumns(move(mfKv.second)).Write(shard_columns);
       }
+    }
+  };
 
-      out << ",";
-      {
-        auto data = dataKv.second.Get(MutualFundData::TYPE::FIVE_YR_NAV_CAGR);
-        if (data != nullptr)
-        {
-          out << *data;
-        }
-      }
+  if (!options.mStreamSource.empty())
+  {
+    // a stream cannot be read again per batch of MF codes, so all funds
+    // are held at once
+    Arena arena;
+    map<long, MutualFund> mutual_funds;
+    try
+    {
+      mutual_funds = StreamNavReports(options, navDir, arena);
+    }
+    catch (const exception& e)
+    {
+      cout << e.what() << endl;
+      return 1;
+    }
+    ReportAllocations("streaming MF data");
+    process_batch(mutual_funds);
+  }
+  else
+  {
+    vector<string> file_names = GetNavFileNames(navDir);
+    stringstream raw_mf_data = options.mNumShards > 0 ?
+      ReadShardNavFiles(file_names, options.mShard, options.mNumShards) :
+      ReadAllNavFiles(file_names, *io);
+    ReportAllocations("reading NAV files");
+    auto res = ReadMFCode(raw_mf_data);
+    ReportAllocations("reading MF codes");
+
+    long min_mf_code = get<0>(res);
+    long max_mf_code = get<1>(res);
+
+    long starting_mf_code = min_mf_code;
+    while (starting_mf_code <= max_mf_code)
+    {
+      long ending_mf_code = min(starting_mf_code + batchSize,
+                                max_mf_code);
+      Arena arena;
+      map<long, MutualFund> mutual_funds = ReadMFData(raw_mf_data,
+                                                      starting_mf_code,
+                                                      ending_mf_code,
+                                                      arena);
+      ReportAllocations("reading MF data");
+      process_batch(mutual_funds);
+
+      starting_mf_code = ending_mf_code + 1;
+    }
+  }
 
-      out << ",";
-      {
-        auto data = dataKv.second.Get(
-            MutualFundData::TYPE::TWO_YR_VARIANCE_SUM_FOR_ONE_YR_NAV_CAGR);
-        if (data != nullptr)
-        {
-          out << pow(*data / 730.0f, 0.5f);
-        }
-      }
+  if (pack_writer && !pack_writer->Close())
+  {
+    return 1;
+  }
+  if (compressor && !compressor->Finish())
+  {
+    return 1;
+  }
 
-      out << ",";
+  WriteMfCodeLookupToCsv(out_dir, mf_code_lookup, mf_category_lookup);
+
+  if (options.mSipXirr)
+  {
+    WriteSipXirr(out_dir, options.mSipWindowMonths, sip_xirr);
+  }
+
+  if (options.mNumShards > 0)
+  {
+    // the cross fund outputs are calculated when the shards are merged
+    if (options.mCorrEnabled)
+    {
+      WriteDailyReturns(out_dir, daily_returns);
+    }
+
+    if (shard_columns.is_open())
+    {
+      shard_columns.close();
+      if (shard_columns.fail())
       {
-        auto data = dataKv.second.Get(
-            MutualFundData::TYPE::FOUR_YR_VARIANCE_SUM_FOR_ONE_YR_NAV_CAGR);
-        if (data != nullptr)
-        {
-          out << pow(*data / 1460.0f, 0.5f);
-        }
+        cout << "Could not write " << out_dir << "/columns.bin" << endl;
+        return 1;
       }
-
-      out << endl;
     }
 
-    out.close();
+    ofstream manifest((out_dir + "/manifest.csv").c_str());
+    manifest << shard_manifest;
   }
-
-  for (auto& mfKv : mutualFunds)
+  else
   {
-    mfCodeLookup << to_string(mfKv.first) << ","
-                 << mfKv.second.mName
-                 << endl;
+    WriteCrossFundOutputs(csvDir, options, all_funds, daily_returns);
   }
 
-  cout << "Wrote CSVs for " << mutualFunds.size()
-       << " mutual funds" << endl;
+  cout << fixed << setprecision(1) << "NAVs and statistics held in "
+       << (options.mCompactColumns ? "compact" : "double") << " storage: "
+       << max_batch_bytes / 1048576.0 << " MB for the largest batch, "
+       << all_funds_bytes / 1048576.0 << " MB for the cross fund outputs"
+       << endl;
+
+  io->PrintStats("I/O backend ");
+
+  return 0;
 }
 
+// every file under directory + relativeDir, with its path relative to
+// directory, and the subdirectories, each after those within it
 void
-WriteMfCodeLookupToCsv(const string& directory,
-                       const stringstream& mfCodeLookup)
+ListFiles(const string& directory,
+          const string& relativeDir,
+          vector<string>& files,
+          vector<string>& subdirectories)
 {
-  cout << "Writing CSV for MF Code lookup" << endl;
-
-  string file_name = directory + "/mf_code_names.csv";
-  ofstream out(file_name.c_str());
-  out << mfCodeLookup.rdbuf();
-  out.close();
+  struct dirent* dir;
+  DIR* dirp = opendir((directory + relativeDir).c_str());
+  if (!dirp)
+  {
+    return;
+  }
 
-  string file_name1 = directory + "/format.csv";
-  ofstream out1(file_name1.c_str());
+  while ((dir = readdir(dirp)) != 0)
+  {
+    const string name = dir->d_name;
+    if (name == "." || name == "..")
+    {
+      continue;
+    }
 
-  out1 << "Date,"
-       << "NAV,"                          // 0
-       << "1 Mnth Avg,"                   // 1
-       << "1 Yr Cagr,"                    // 2
-       << "3 Yr Cagr,"                    // 3
-       << "5 Yr Cagr,"                    // 4
-       << "2 Yr Std Dev of 1 Yr Cagr,"    // 5
-       << "4 Yr Std Dev of 1 Yr Cagr,"    // 6
-       << endl;
+    const string path = relativeDir + "/" + name;
+    struct stat st;
+    if (stat((directory + path).c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+    {
+      ListFiles(directory, path, files, subdirectories);
+      subdirectories.push_back(path);
+    }
+    else
+    {
+      files.push_back(path);
+    }
+  }
 
-  out1.close();
+  closedir(dirp);
+}
 
-  cout << "Wrote CSV for MF Code lookup" << endl;
+string
+ReadWholeFile(const string& fileName)
+{
+  ifstream in(fileName.c_str(), ios::binary);
+  stringstream content;
+  content << in.rdbuf();
+  return content.str();
 }
 
-long
-GetCurrentTimeSecs()
+int
+VerifyStorage(const string& navDir,
+              const string& csvDir,
+              const Options& options,
+              long batchSize)
 {
-  struct timeval tp;
-  gettimeofday(&tp, NULL);
-  long secs = tp.tv_sec + tp.tv_usec / 1000000;
-  return secs;
+  // Runs the batches with the given options once with double and once with
+  // compact storage, each into its own scratch directory, and checks that
+  // every file they write is the same.
+  const string scratch_dir = csvDir + "/verify_storage";
+  const char* modes[] = { "double", "compact" };
+  mkdir(scratch_dir.c_str(), 0755);
+  for (const char* mode : modes)
+  {
+    Options mode_options = options;
+    mode_options.mVerifyStorage = false;
+    mode_options.mCompactColumns = string(mode) == "compact";
+
+    const string mode_dir = scratch_dir + "/" + mode;
+    mkdir(mode_dir.c_str(), 0755);
+    cout << "Running with " << mode << " storage" << endl;
+    int status = RunBatches(navDir, mode_dir, mode_options, batchSize);
+    if (status != 0)
+    {
+      return status;
+    }
+  }
+
+  const string double_dir = scratch_dir + "/double";
+  const string compact_dir = scratch_dir + "/compact";
+  vector<string> files;
+  vector<string> subdirectories;
+  vector<string> compact_files;
+  vector<string> compact_subdirectories;
+  ListFiles(double_dir, "", files, subdirectories);
+  ListFiles(compact_dir, "", compact_files, compact_subdirectories);
+  sort(files.begin(), files.end());
+  sort(compact_files.begin(), compact_files.end());
+
+  long num_differing = 0;
+  if (files != compact_files)
+  {
+    cout << "Compact storage wrote " << compact_files.size()
+         << " files instead of " << files.size() << endl;
+    ++num_differing;
+  }
+
+  long num_same = 0;
+  for (auto& file : files)
+  {
+    if (ReadWholeFile(double_dir + file) == ReadWholeFile(compact_dir + file))
+    {
+      ++num_same;
+    }
+    else if (num_differing++ < 10)
+    {
+      cout << file.substr(1) << " differs with compact storage" << endl;
+    }
+  }
+
+  cout << num_same << " of " << files.size()
+       << " files are the same with compact storage" << endl;
+
+  if (num_differing > 0)
+  {
+    cout << "Kept the outputs in " << scratch_dir << endl;
+    return 1;
+  }
+
+  for (auto& dir : { double_dir, compact_dir })
+  {
+    vector<string> dir_files;
+    vector<string> dir_subdirectories;
+    ListFiles(dir, "", dir_files, dir_subdirectories);
+    for (auto& file : dir_files)
+    {
+      unlink((dir + file).c_str());
+    }
+    for (auto& subdirectory : dir_subdirectories)
+    {
+      rmdir((dir + subdirectory).c_str());
+    }
+    rmdir(dir.c_str());
+  }
+  rmdir(scratch_dir.c_str());
+
+  return 0;
 }
 
 int
-main()
+main(int argc, char* argv[])
 {
   long start_secs = GetCurrentTimeSecs();
 
+  Options options;
+  if (!ParseOptions(argc, argv, options))
+  {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
   const string nav_dir = "nav";
   const string csv_dir = "static/csv";
   const long MF_BATCH_SIZE = 5000;
 
-  vector<string> file_names = GetNavFileNames(nav_dir);
-  stringstream raw_mf_data = ReadAllNavFiles(file_names);
-  auto res = ReadMFCode(raw_mf_data);
+  if (options.mDaemon)
+  {
+    return RunDaemon(nav_dir, options);
+  }
 
-  long min_mf_code = get<0>(res);
-  long max_mf_code = get<1>(res);
+  if (options.mIoBenchmark)
+  {
+    RunIoBenchmark(nav_dir, csv_dir);
+    return 0;
+  }
 
-  stringstream mf_code_lookup;
+  if (options.mVerifyStorage)
+  {
+    return VerifyStorage(nav_dir, csv_dir, options, MF_BATCH_SIZE);
+  }
 
-  long starting_mf_code = min_mf_code;
-  while (starting_mf_code <= max_mf_code)
+  if (options.mBuildIndex)
   {
-    long ending_mf_code = min(starting_mf_code + MF_BATCH_SIZE, max_mf_code);
-    map<long, MutualFund> mutual_funds = ReadMFData(raw_mf_data,
-                                                    starting_mf_code,
-                                                    ending_mf_code);
-    AddMissingDates(mutual_funds);
-    CalculateStatistics(mutual_funds);
-    WriteToCsv(mutual_funds, csv_dir, mf_code_lookup);
+    vector<string> file_names = GetNavFileNames(nav_dir);
+    int num_built = 0;
+    for (auto& file_name : file_names)
+    {
+      num_built += CodeIndex(file_name).Built();
+    }
+    cout << "Built " << num_built << " of " << file_names.size()
+         << " code indexes, the rest were up to date" << endl;
+    return 0;
+  }
 
-    starting_mf_code = ending_mf_code + 1;
+  if (options.mMergeShards > 0)
+  {
+    return MergeShards(csv_dir, nav_dir, options);
   }
 
-  WriteMfCodeLookupToCsv(csv_dir, mf_code_lookup);
+  int status = RunBatches(nav_dir, csv_dir, options, MF_BATCH_SIZE);
+  if (status != 0)
+  {
+    return status;
+  }
 
   long end_secs = GetCurrentTimeSecs();
   cout << "Time taken: "
@@ -63,7 +63,7 @@ function addLabels(chartConfig, startDate, endDate, periodicity) {
 }
 
 function getChart(mfCode, hiddenCharts, mfColor) {
-  readTextFile(mfCode, "/static/csv/" + mfCode + ".csv", hiddenCharts, mfColor);
+  readTextFile(mfCode, "/navs/" + mfCode + ".csv", hiddenCharts, mfColor);
 }
 
 function readTextFile(mfCode, url, hiddenCharts, mfColor) {
@@ -316,13 +316,27 @@ function addButton(mfCode, textColor) {
 }
 
 function getNavLabel(mfCode) {
-  if (mfLabelLookup === undefined) {
-    mfLabelLookup = {};
-    for (var i = 0; i < mf_name_codes.length; i++) {
-      mfLabelLookup[mf_name_codes[i].mfcode] = mf_name_codes[i].label;
+  return mfLabelLookup[mfCode];
+}
+
+function readMfLabels(mfCodes, callback) {
+  // fetch the names of the funds not picked from the search results, funds
+  // without one (or all of them if the request fails) are labelled with
+  // their code
+  for (var i = 0; i < mfCodes.length; i++) {
+    if (mfLabelLookup[mfCodes[i]] === undefined) {
+      mfLabelLookup[mfCodes[i]] = String(mfCodes[i]);
     }
   }
-  return mfLabelLookup[mfCode];
+
+  $.getJSON("/names", { codes: mfCodes.join(",") }, function(names) {
+    for (var mfCode in names) {
+      mfLabelLookup[mfCode] = names[mfCode];
+    }
+    callback();
+  }).fail(function() {
+    callback();
+  });
 }
 
 function mfAutocompleteCb(ui) {
@@ -331,6 +345,8 @@ function mfAutocompleteCb(ui) {
     return;
   }
 
+  mfLabelLookup[ui.item.mfcode] = ui.item.label;
+
   for (var i = 0; i < navConfig.data.datasets.length; i++) {
     if (navConfig.data.datasets[i].mfCode == ui.item.mfcode) {
       // element already exists
@@ -440,7 +456,8 @@ var navChart;
 var retConfig;
 var retChart;
 
-var mfLabelLookup;
+// labels of the funds charted, from the search results or /names
+var mfLabelLookup = {};
 
 // month is 0 indexed
 var defStartDate = moment({ year: 2006, month: 3, day: 1 });
@@ -451,25 +468,12 @@ var chartColors;
 $(function() {
   // https://jqueryui.com/autocomplete/
   $("#inputMfSearch").autocomplete({
-    //source: mf_name_codes,
     //delay: 300,
     //minLength: 2,
     source: function(request, response) {
-      var terms = request.term.split(" ");
-      var results = [];
-      // use each term to narrow down the results
-      for (var i = 0; i < terms.length; i++) {
-        if (terms[i].length > 0) {
-          if (results.length == 0) {
-            results = $.ui.autocomplete.filter(mf_name_codes, terms[i]);
-          } else {
-            results = $.ui.autocomplete.filter(results, terms[i]);
-          }
-        }
-      }
-      // pick only top 50 results to avoid slowing down the browser
-      // delegate back to autocomplete
-      response(results.slice(0, 50));
+      // the server narrows down the names with each space separated term
+      // and returns only the top results
+      $.getJSON("/search", { term: request.term }, response);
     },
     select: function(event, ui) {
       mfAutocompleteCb(ui);
@@ -599,10 +603,12 @@ $(function() {
   navChart = new Chart(document.getElementById("canvasNavChart"), navConfig);
   retChart = new Chart(document.getElementById("canvasRetChart"), retConfig);
 
-  getChart("113177", [], null);
-  getChart("130502", [], null);
-  getChart("125494", [], null);
-  getChart("100822", [], null);
+  var defaultMfCodes = ["113177", "130502", "125494", "100822"];
+  readMfLabels(defaultMfCodes, function() {
+    for (var i = 0; i < defaultMfCodes.length; i++) {
+      getChart(defaultMfCodes[i], [], null);
+    }
+  });
 
   // Serialize URL
   // https://gka.github.io/palettes/
@@ -60,13 +60,13 @@ $(function() {
   portfolioChart = new Chart(document.getElementById("canvasPortfolioChart"),
                              portfolioConfig);
 
-  mfLabelLookup = {};
-  for (var i = 0; i < mf_name_codes.length; i++) {
-    mfLabelLookup[parseInt(mf_name_codes[i].mfcode, 10)] =
-      mf_name_codes[i].label;
+  // /portfolio?backtest=<variant> charts a backtest from backtest.csv instead
+  var backtest = new URLSearchParams(window.location.search).get("backtest");
+  if (backtest) {
+    readCsvFile("/static/csv/backtest/" + backtest + ".csv");
+  } else {
+    readCsvFile("/static/csv/transactions.csv");
   }
-
-  readCsvFile("/static/csv/transactions.csv");
 })
 
 function readCsvFile(url) {
@@ -79,11 +79,32 @@ function readCsvFile(url) {
   req.onreadystatechange = function() {
     // file is downloaded
     if (req.readyState === XMLHttpRequest.DONE) {
-      addChart(readCsv(req.responseText));
+      var portfolioData = readCsv(req.responseText);
+      readMfLabels(portfolioData[4], function() {
+        addChart(portfolioData);
+      });
     }
   }
 }
 
+function readMfLabels(mfCodes, callback) {
+  // fetch the names of only the funds in the portfolio, funds without one
+  // (or all of them if the request fails) are labelled with their code
+  mfLabelLookup = {};
+  for (var i = 0; i < mfCodes.length; i++) {
+    mfLabelLookup[parseInt(mfCodes[i], 10)] = String(mfCodes[i]);
+  }
+
+  $.getJSON("/names", { codes: mfCodes.join(",") }, function(names) {
+    for (var mfCode in names) {
+      mfLabelLookup[parseInt(mfCode, 10)] = names[mfCode];
+    }
+    callback();
+  }).fail(function() {
+    callback();
+  });
+}
+
 function readCsv(csvData) {
   // read all csv entries to a dict
   var csvLines = csvData.split(/\r?\n/);